@@ -0,0 +1,1048 @@
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QProcess>
+#include <QSettings>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+#include <QtAlgorithms>
+#include <QRect>
+#include <QSize>
+#include <QPoint>
+
+#include "liblxqt-settings.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmarks LxQt::Settings against QSettings. Unless --no-isolation is
+// given, everything runs against a private session bus, dconf database and
+// QSettings directory in a temporary directory, so no user session is
+// needed and nothing of the user's is touched.
+//
+// Every result is one JSON object per line on stdout (or --output):
+//   {"suite":"operations","backend":"lxqt","operation":"value","keys":1000,
+//    "samples":1000,"p50_ns":..,"p90_ns":..,"p99_ns":..,"max_ns":..,
+//    "ops_per_sec":..,"allocs_per_op":..,"alloc_bytes_per_op":..}
+
+#ifdef __GLIBC__
+// Count heap allocations of the whole process, Qt and GLib included, by
+// interposing malloc() in the executable.
+extern "C" {
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *ptr);
+
+static long s_allocations = 0;
+static long s_allocatedBytes = 0;
+// blocks allocated minus blocks freed while counting, for the soak suite
+static long s_liveBlocks = 0;
+// the shared counters would serialise the threads suite
+static volatile bool s_countAllocations = true;
+
+static void countAllocation(size_t size, long blocks)
+{
+    if (!s_countAllocations)
+        return;
+    __sync_fetch_and_add(&s_allocations, 1);
+    __sync_fetch_and_add(&s_allocatedBytes, long(size));
+    if (blocks)
+        __sync_fetch_and_add(&s_liveBlocks, blocks);
+}
+
+void *malloc(size_t size)
+{
+    countAllocation(size, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    countAllocation(n * size, 1);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    // realloc(NULL, n) allocates, realloc(p, 0) frees
+    countAllocation(size, !ptr ? 1 : size == 0 ? -1 : 0);
+    return __libc_realloc(ptr, size);
+}
+
+// The aligned allocators too: their blocks come back through free().
+void *memalign(size_t alignment, size_t size)
+{
+    countAllocation(size, 1);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    countAllocation(size, 1);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+        return EINVAL;
+
+    void *block = __libc_memalign(alignment, size);
+    if (!block)
+        return ENOMEM;
+
+    countAllocation(size, 1);
+    *ptr = block;
+    return 0;
+}
+
+void *valloc(size_t size)
+{
+    countAllocation(size, 1);
+    return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size)
+{
+    countAllocation(size, 1);
+    return __libc_pvalloc(size);
+}
+
+void free(void *ptr)
+{
+    if (ptr && s_countAllocations)
+        __sync_fetch_and_sub(&s_liveBlocks, 1);
+    __libc_free(ptr);
+}
+}
+
+static long allocations() { return __sync_fetch_and_add(&s_allocations, 0); }
+static long allocatedBytes() { return __sync_fetch_and_add(&s_allocatedBytes, 0); }
+static long liveBlocks() { return __sync_fetch_and_add(&s_liveBlocks, 0); }
+static void setCountAllocations(bool count) { s_countAllocations = count; }
+#else
+static long allocations() { return 0; }
+static long allocatedBytes() { return 0; }
+static long liveBlocks() { return 0; }
+static void setCountAllocations(bool) {}
+#endif
+
+// CLOCK_MONOTONIC is shared by all processes, so the latency suite can
+// compare stamps taken in the writer with its own.
+static qint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Resident set size in KiB, or 0 where /proc is not available.
+static long residentKiB()
+{
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    if (fscanf(statm, "%*ld %ld", &pages) != 1)
+        pages = 0;
+    fclose(statm);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static const char *Organization = "lxde";
+static const char *Application = "settings-benchmark";
+
+// Collects per operation timings and allocations.
+class Samples
+{
+public:
+    Samples()
+        : m_allocations(0)
+        , m_allocatedBytes(0)
+    {
+    }
+
+    void start()
+    {
+        m_startAllocations = allocations();
+        m_startBytes = allocatedBytes();
+        m_timer.start();
+    }
+
+    void stop()
+    {
+        m_ns.append(m_timer.nsecsElapsed());
+        m_allocations += allocations() - m_startAllocations;
+        m_allocatedBytes += allocatedBytes() - m_startBytes;
+    }
+
+    // a duration measured elsewhere, without allocations
+    void add(qint64 ns) { m_ns.append(ns); }
+
+    int count() const { return m_ns.size(); }
+    qint64 total() const;
+    qint64 percentile(double p);
+    double allocationsPerOp() const { return m_ns.isEmpty() ? 0 : double(m_allocations) / m_ns.size(); }
+    double allocatedBytesPerOp() const { return m_ns.isEmpty() ? 0 : double(m_allocatedBytes) / m_ns.size(); }
+
+private:
+    QVector<qint64> m_ns;
+    QElapsedTimer m_timer;
+    long m_startAllocations;
+    long m_startBytes;
+    long m_allocations;
+    long m_allocatedBytes;
+};
+
+qint64 Samples::total() const
+{
+    qint64 result = 0;
+    Q_FOREACH (qint64 ns, m_ns)
+        result += ns;
+    return result;
+}
+
+qint64 Samples::percentile(double p)
+{
+    if (m_ns.isEmpty())
+        return 0;
+    qSort(m_ns);
+    return m_ns[qMin(m_ns.size() - 1, int(p * m_ns.size()))];
+}
+
+class Reporter
+{
+public:
+    explicit Reporter(QIODevice *device)
+        : m_out(device)
+    {
+    }
+
+    void report(const char *suite, const char *backend, const QString &operation,
+                int keys, Samples &samples, const QString &extra = QString());
+    void line(const QString &json) { m_out << json << '\n'; m_out.flush(); }
+
+private:
+    QTextStream m_out;
+};
+
+void Reporter::report(const char *suite, const char *backend, const QString &operation,
+                      int keys, Samples &samples, const QString &extra)
+{
+    qint64 total = samples.total();
+    double opsPerSec = total ? samples.count() * 1e9 / total : 0;
+
+    m_out << "{\"suite\":\"" << suite << "\""
+          << ",\"backend\":\"" << backend << "\""
+          << ",\"operation\":\"" << operation << "\""
+          << ",\"keys\":" << keys
+          << ",\"samples\":" << samples.count()
+          << ",\"p50_ns\":" << samples.percentile(0.50)
+          << ",\"p90_ns\":" << samples.percentile(0.90)
+          << ",\"p99_ns\":" << samples.percentile(0.99)
+          << ",\"max_ns\":" << samples.percentile(1.0)
+          << ",\"ops_per_sec\":" << qRound64(opsPerSec)
+          << ",\"allocs_per_op\":" << samples.allocationsPerOp()
+          << ",\"alloc_bytes_per_op\":" << samples.allocatedBytesPerOp();
+    if (!extra.isEmpty())
+        m_out << ',' << extra;
+    m_out << "}\n";
+    m_out.flush();
+}
+
+
+// The isolated environment: a temporary directory holding the dconf
+// profile, database and runtime directory, and a private session bus that
+// activates dconf-service with that environment.
+class Isolation
+{
+public:
+    Isolation();
+    ~Isolation();
+
+    bool start();
+
+private:
+    static void removeRecursively(const QString &path);
+
+    QString m_dir;
+    pid_t m_busPid;
+};
+
+Isolation::Isolation()
+    : m_busPid(0)
+{
+}
+
+Isolation::~Isolation()
+{
+    if (m_busPid > 0)
+        kill(m_busPid, SIGTERM);
+    if (!m_dir.isEmpty())
+        removeRecursively(m_dir);
+}
+
+bool Isolation::start()
+{
+    QByteArray dir = QFile::encodeName(QDir::tempPath() + QLatin1String("/lxqt-settings-benchmark-XXXXXX"));
+    if (!mkdtemp(dir.data()))
+    {
+        qWarning("cannot create a temporary directory");
+        return false;
+    }
+    m_dir = QFile::decodeName(dir);
+
+    QDir root(m_dir);
+    root.mkpath(QLatin1String("config"));
+    root.mkpath(QLatin1String("runtime"));
+    root.mkpath(QLatin1String("qsettings"));
+
+    QFile profile(root.filePath(QLatin1String("profile")));
+    if (!profile.open(QIODevice::WriteOnly) || profile.write("user-db:user\n") < 0)
+    {
+        qWarning("cannot write the dconf profile");
+        return false;
+    }
+    profile.close();
+
+    qputenv("XDG_CONFIG_HOME", QFile::encodeName(root.filePath(QLatin1String("config"))));
+    qputenv("XDG_RUNTIME_DIR", QFile::encodeName(root.filePath(QLatin1String("runtime"))));
+    qputenv("DCONF_PROFILE", QFile::encodeName(profile.fileName()));
+    QSettings::setPath(QSettings::NativeFormat, QSettings::UserScope, root.filePath(QLatin1String("qsettings")));
+    QSettings::setPath(QSettings::IniFormat, QSettings::UserScope, root.filePath(QLatin1String("qsettings")));
+
+    QProcess bus;
+    bus.start(QLatin1String("dbus-daemon"), QStringList()
+              << QLatin1String("--session")
+              << QLatin1String("--fork")
+              << QLatin1String("--print-address=1")
+              << QLatin1String("--print-pid=1"));
+    if (!bus.waitForFinished() || bus.exitCode() != 0)
+    {
+        qWarning("cannot start a private dbus-daemon");
+        return false;
+    }
+
+    QList<QByteArray> lines = bus.readAllStandardOutput().split('\n');
+    if (lines.size() < 2)
+    {
+        qWarning("unexpected dbus-daemon output");
+        return false;
+    }
+    qputenv("DBUS_SESSION_BUS_ADDRESS", lines[0].trimmed());
+    m_busPid = pid_t(lines[1].trimmed().toInt());
+    return true;
+}
+
+void Isolation::removeRecursively(const QString &path)
+{
+    QFileInfo info(path);
+    if (info.isDir() && !info.isSymLink())
+    {
+        QDir dir(path);
+        Q_FOREACH (const QString &entry, dir.entryList(QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot))
+            removeRecursively(dir.filePath(entry));
+        dir.rmdir(path);
+    }
+    else
+    {
+        QFile::remove(path);
+    }
+}
+
+
+// Lets the operation suite drive both implementations with the same code.
+static void beginBatch(LxQt::Settings &settings) { settings.beginTransaction(); }
+static void beginBatch(QSettings &) {}
+static void endBatch(LxQt::Settings &settings) { settings.commit(); }
+static void endBatch(QSettings &) {}
+static void clearGroup(LxQt::Settings &settings) { settings.clear(); }
+static void clearGroup(QSettings &settings) { settings.remove(QString()); } // QSettings::clear() ignores the group
+
+static QString groupName(int i) { return QString::fromLatin1("g%1").arg(i / 100); }
+static QString keyName(int i) { return QString::fromLatin1("k%1").arg(i % 100); }
+
+template <class S>
+static void populate(S &settings, const QStringList &keys)
+{
+    beginBatch(settings);
+    for (int i = 0; i < keys.size(); ++i)
+    {
+        settings.setValue(keys[i], i);
+        if (i % 1000 == 999)
+        {
+            endBatch(settings);
+            beginBatch(settings);
+        }
+    }
+    endBatch(settings);
+
+    int arraySize = qMin(keys.size(), 1000);
+    settings.beginWriteArray(QLatin1String("array"));
+    for (int i = 0; i < arraySize; ++i)
+    {
+        settings.setArrayIndex(i);
+        settings.setValue(QLatin1String("value"), i);
+    }
+    settings.endArray();
+    settings.sync();
+}
+
+template <class S>
+static void runOperations(Reporter &reporter, const char *backend, S &settings, int size, int iterations)
+{
+    QStringList keys;
+    for (int i = 0; i < size; ++i)
+        keys += groupName(i) + QLatin1Char('/') + keyName(i);
+    populate(settings, keys);
+
+    // the whole tree costs O(size) per call, so take fewer samples of it
+    int treeIterations = qBound(5, iterations * 10 / size, iterations);
+
+    qsrand(42);
+    Samples samples;
+    for (int i = 0; i < iterations; ++i)
+    {
+        const QString &key = keys[qrand() % size];
+        samples.start();
+        settings.value(key);
+        samples.stop();
+    }
+    reporter.report("operations", backend, QLatin1String("value"), size, samples);
+
+    samples = Samples();
+    for (int i = 0; i < iterations; ++i)
+    {
+        const QString &key = keys[qrand() % size];
+        samples.start();
+        settings.setValue(key, i);
+        samples.stop();
+    }
+    settings.sync();
+    reporter.report("operations", backend, QLatin1String("setValue"), size, samples);
+
+    samples = Samples();
+    for (int i = 0; i < iterations; ++i)
+    {
+        QString key = i % 2 ? keys[qrand() % size] : QLatin1String("missing/") + keys[qrand() % size];
+        samples.start();
+        settings.contains(key);
+        samples.stop();
+    }
+    reporter.report("operations", backend, QLatin1String("contains"), size, samples);
+
+    samples = Samples();
+    for (int i = 0; i < treeIterations; ++i)
+    {
+        samples.start();
+        settings.allKeys();
+        samples.stop();
+    }
+    reporter.report("operations", backend, QLatin1String("allKeys"), size, samples);
+
+    samples = Samples();
+    for (int i = 0; i < iterations; ++i)
+    {
+        samples.start();
+        settings.beginReadArray(QLatin1String("array"));
+        settings.endArray();
+        samples.stop();
+    }
+    reporter.report("operations", backend, QLatin1String("beginReadArray"), size, samples,
+                    QString::fromLatin1("\"array_size\":%1").arg(qMin(size, 1000)));
+
+    samples = Samples();
+    for (int i = 0; i < iterations; ++i)
+    {
+        int index = qrand() % size;
+        samples.start();
+        settings.remove(keys[index]);
+        samples.stop();
+        settings.setValue(keys[index], index);
+    }
+    settings.sync();
+    reporter.report("operations", backend, QLatin1String("remove"), size, samples);
+
+    samples = Samples();
+    int groups = (size + 99) / 100;
+    for (int i = 0; i < qMin(iterations, 100); ++i)
+    {
+        int first = (qrand() % groups) * 100;
+        settings.beginGroup(groupName(first));
+        samples.start();
+        clearGroup(settings);
+        samples.stop();
+        beginBatch(settings);
+        for (int j = first; j < qMin(first + 100, size); ++j)
+            settings.setValue(keyName(j), j);
+        endBatch(settings);
+        settings.endGroup();
+    }
+    settings.sync();
+    reporter.report("operations", backend, QLatin1String("clear"), size, samples);
+
+    clearGroup(settings);
+    settings.sync();
+}
+
+// Binary blobs: write and cold read throughput and the bytes allocated per
+// byte of payload, i.e. roughly how often the blob gets copied. Returns
+// false when a blob does not read back as written.
+static bool runBlobs(Reporter &reporter, int iterations)
+{
+    bool intact = true;
+    static const int sizes[] = { 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        int size = sizes[s];
+        int count = qBound(5, iterations * 1024 / size, iterations);
+
+        QByteArray blob(size, '\0');
+        for (int i = 0; i < size; ++i)
+            blob[i] = char(qrand());
+
+        Samples writes;
+        {
+            LxQt::Settings writer(QLatin1String(Organization), QLatin1String(Application));
+            // the "ay" path; StringStorage only takes it for blobs with NUL bytes
+            writer.setStorageFormat(LxQt::Settings::NativeStorage);
+            writer.beginGroup(QLatin1String("blobs"));
+            for (int i = 0; i < count; ++i)
+            {
+                blob[0] = char(i);
+                writes.start();
+                writer.setValue(QString::number(i), blob);
+                writes.stop();
+            }
+            writer.sync();
+        }
+
+        Samples reads;
+        {
+            // a fresh instance, so every read decodes from dconf
+            LxQt::Settings reader(QLatin1String(Organization), QLatin1String(Application));
+            reader.beginGroup(QLatin1String("blobs"));
+            for (int i = 0; i < count; ++i)
+            {
+                reads.start();
+                QByteArray value = reader.value(QString::number(i)).toByteArray();
+                reads.stop();
+                blob[0] = char(i);
+                if (value != blob)
+                {
+                    qWarning("blobs: blob %d of %d bytes reads back wrong (%d bytes)", i, size, value.size());
+                    intact = false;
+                }
+            }
+            reader.clear();
+        }
+
+        QString extra = QString::fromLatin1("\"blob_bytes\":%1,\"mb_per_sec\":%2,\"copies_per_op\":%3");
+        double mb = double(size) / (1024 * 1024);
+        reporter.report("blobs", "lxqt", QLatin1String("setValue"), count, writes,
+                        extra.arg(size).arg(writes.total() ? mb * writes.count() * 1e9 / writes.total() : 0)
+                             .arg(writes.allocatedBytesPerOp() / size));
+        reporter.report("blobs", "lxqt", QLatin1String("value"), count, reads,
+                        extra.arg(size).arg(reads.total() ? mb * reads.count() * 1e9 / reads.total() : 0)
+                             .arg(reads.allocatedBytesPerOp() / size));
+    }
+    return intact;
+}
+
+// Decoding throughput over a corpus of typical values, stored in either
+// format and read back cold.
+static void runCodec(Reporter &reporter, int iterations)
+{
+    QVariantList corpus;
+    corpus << 0 << 42 << -123456 << true << false << 3.25 << 123.45
+           << QString::fromLatin1("plain text") << QString::fromLatin1("@escaped")
+           << QString::fromUtf8("\xc3\xa9t\xc3\xa9") << QStringList()
+           << QRect(10, 20, 640, 480) << QSize(800, 600) << QPoint(-5, 7)
+           << QByteArray("binary\0data", 11) << QVariant();
+
+    static const LxQt::Settings::StorageFormat formats[] = { LxQt::Settings::StringStorage, LxQt::Settings::NativeStorage };
+    static const char *names[] = { "string", "native" };
+
+    for (int f = 0; f < 2; ++f)
+    {
+        {
+            LxQt::Settings writer(QLatin1String(Organization), QLatin1String(Application));
+            writer.setStorageFormat(formats[f]);
+            writer.beginGroup(QLatin1String("codec"));
+            for (int i = 0; i < corpus.size(); ++i)
+                writer.setValue(QString::number(i), corpus[i]);
+            writer.sync();
+        }
+
+        Samples samples;
+        int passes = qMax(1, iterations / corpus.size());
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            LxQt::Settings reader(QLatin1String(Organization), QLatin1String(Application));
+            reader.beginGroup(QLatin1String("codec"));
+            for (int i = 0; i < corpus.size(); ++i)
+            {
+                samples.start();
+                reader.value(QString::number(i));
+                samples.stop();
+            }
+            if (pass == passes - 1)
+                reader.clear();
+        }
+
+        reporter.report("codec", "lxqt", QString::fromLatin1("value-%1").arg(QLatin1String(names[f])), corpus.size(), samples);
+    }
+}
+
+// Path handling: the same warm read through a group relative string key and
+// through a pre-resolved key handle.
+static void runKeys(Reporter &reporter, int iterations)
+{
+    LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application));
+    settings.beginGroup(QLatin1String("keys/nested/group"));
+    settings.setValue(QLatin1String("value"), 1);
+    LxQt::Settings::Key key = settings.key(QLatin1String("value"));
+    QString name = QLatin1String("value");
+    settings.value(key);
+
+    Samples samples;
+    for (int i = 0; i < iterations; ++i)
+    {
+        samples.start();
+        settings.value(name);
+        samples.stop();
+    }
+    reporter.report("keys", "lxqt", QLatin1String("value-string"), 1, samples);
+
+    samples = Samples();
+    for (int i = 0; i < iterations; ++i)
+    {
+        samples.start();
+        settings.value(key);
+        samples.stop();
+    }
+    reporter.report("keys", "lxqt", QLatin1String("value-key"), 1, samples);
+
+    samples = Samples();
+    for (int i = 0; i < iterations; ++i)
+    {
+        samples.start();
+        settings.beginGroup(QLatin1String("child"));
+        settings.endGroup();
+        samples.stop();
+    }
+    reporter.report("keys", "lxqt", QLatin1String("beginGroup-endGroup"), 1, samples);
+
+    settings.clear();
+}
+
+// Reads pre-resolved keys of a shared Settings object from its own thread.
+class ReaderThread : public QThread
+{
+public:
+    ReaderThread(const LxQt::Settings &settings, const QList<LxQt::Settings::Key> &keys, int reads)
+        : m_settings(settings)
+        , m_keys(keys)
+        , m_reads(reads)
+    {
+    }
+
+protected:
+    void run()
+    {
+        int n = m_keys.size();
+        for (int i = 0; i < m_reads; ++i)
+            m_settings.value(m_keys[i % n]);
+    }
+
+private:
+    const LxQt::Settings &m_settings;
+    QList<LxQt::Settings::Key> m_keys;
+    int m_reads;
+};
+
+// Read throughput of one Settings object shared by 1 to N threads.
+static void runThreads(Reporter &reporter, int iterations)
+{
+    LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application));
+    settings.beginGroup(QLatin1String("threads"));
+
+    QList<LxQt::Settings::Key> keys;
+    settings.beginTransaction();
+    for (int i = 0; i < 1000; ++i)
+    {
+        keys += settings.key(QString::fromLatin1("k%1").arg(i));
+        settings.setValue(keys.last(), i);
+    }
+    settings.commit();
+    settings.sync();
+    Q_FOREACH (const LxQt::Settings::Key &key, keys)
+        settings.value(key);
+    // publishes the warm cache to the reader threads
+    settings.sync();
+
+    int reads = iterations * 1000;
+    int maxThreads = qMax(1, QThread::idealThreadCount());
+    QList<int> counts;
+    for (int threads = 1; threads < maxThreads; threads *= 2)
+        counts << threads;
+    counts << maxThreads;
+
+    setCountAllocations(false);
+    Q_FOREACH (int threads, counts)
+    {
+        QList<ReaderThread *> workers;
+        for (int i = 0; i < threads; ++i)
+            workers += new ReaderThread(settings, keys, reads);
+
+        QElapsedTimer timer;
+        timer.start();
+        Q_FOREACH (ReaderThread *worker, workers)
+            worker->start();
+        Q_FOREACH (ReaderThread *worker, workers)
+            worker->wait();
+        qint64 ns = timer.nsecsElapsed();
+        qDeleteAll(workers);
+
+        reporter.line(QString::fromLatin1("{\"suite\":\"threads\",\"backend\":\"lxqt\",\"operation\":\"value-key\","
+                                          "\"threads\":%1,\"reads\":%2,\"ops_per_sec\":%3}")
+                      .arg(threads).arg(qint64(reads) * threads)
+                      .arg(qRound64(ns ? double(reads) * threads * 1e9 / ns : 0)));
+    }
+    setCountAllocations(true);
+
+    settings.clear();
+}
+
+// Runs ops mixed reads, writes and enumerations in rounds and checks that
+// neither the resident set nor the number of live heap blocks, GLib's
+// included, keeps growing once the caches are warm. Not run by default.
+static bool runSoak(Reporter &reporter, int ops)
+{
+    static const int Rounds = 20;
+    static const int WarmupRounds = 4;
+    static const int Keys = 1000;
+
+    LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application));
+    settings.beginGroup(QLatin1String("soak"));
+
+    QStringList names;
+    QList<LxQt::Settings::Key> keys;
+    for (int i = 0; i < Keys; ++i)
+    {
+        names += groupName(i * 10) + QLatin1Char('/') + keyName(i);
+        keys += settings.key(names.last());
+    }
+    populate(settings, names);
+
+    int perRound = qMax(1, ops / Rounds);
+    long baseRss = 0;
+    long baseBlocks = 0;
+    long rss = 0;
+    long blocks = 0;
+    for (int round = 0; round < Rounds; ++round)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < perRound; ++i)
+        {
+            int k = (i * 7919) % Keys;
+            switch (i % 8)
+            {
+            case 0:
+            case 1:
+                settings.value(names[k]);
+                break;
+            case 2:
+                settings.value(keys[k]);
+                break;
+            case 3:
+                settings.contains(names[k]);
+                break;
+            case 4:
+                settings.setValue(names[k], QString::number(i));
+                break;
+            case 5:
+                settings.setValue(keys[k], QRect(i, k, round, 1));
+                break;
+            case 6:
+                settings.beginGroup(groupName(k * 10));
+                settings.childKeys();
+                settings.endGroup();
+                break;
+            case 7:
+                if (i % 1000 == 7)
+                    settings.remove(names[k]);
+                else
+                    settings.childGroups();
+                break;
+            }
+
+            // keep dconf's queue of unacknowledged writes bounded
+            if (i % 10000 == 9999)
+                settings.sync();
+        }
+        settings.sync();
+        qint64 ns = timer.nsecsElapsed();
+
+        rss = residentKiB();
+        blocks = liveBlocks();
+        if (round == WarmupRounds - 1)
+        {
+            baseRss = rss;
+            baseBlocks = blocks;
+        }
+
+        reporter.line(QString::fromLatin1("{\"suite\":\"soak\",\"backend\":\"lxqt\",\"round\":%1,\"ops\":%2,"
+                                          "\"ops_per_sec\":%3,\"rss_kib\":%4,\"live_blocks\":%5}")
+                      .arg(round).arg(qint64(perRound) * (round + 1))
+                      .arg(qRound64(ns ? perRound * 1e9 / ns : 0))
+                      .arg(rss).arg(blocks));
+    }
+
+    settings.clear();
+
+    // allow for allocator slack, not for growth with the number of operations
+    bool rssFlat = rss - baseRss <= qMax(1024L, baseRss / 20);
+    bool blocksFlat = blocks - baseBlocks <= qMax(1000L, baseBlocks / 50);
+    reporter.line(QString::fromLatin1("{\"suite\":\"soak\",\"backend\":\"lxqt\",\"rss_growth_kib\":%1,"
+                                      "\"live_block_growth\":%2,\"flat\":%3}")
+                  .arg(rss - baseRss).arg(blocks - baseBlocks)
+                  .arg(QLatin1String(rssFlat && blocksFlat ? "true" : "false")));
+    return rssFlat && blocksFlat;
+}
+
+// The other process of the latency suite: for every line on stdin, writes
+// the current time to latency/stamp and waits for dconf to take it.
+static int runLatencyWriter()
+{
+    LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application));
+    char line[16];
+    while (fgets(line, sizeof(line), stdin))
+    {
+        settings.setValue(QLatin1String("latency/stamp"), monotonicNs());
+        settings.sync();
+    }
+    return 0;
+}
+
+// Time from a write in another process to changed() here, which includes
+// dconf-service, the bus and the notification thread handing the change to
+// this thread's event loop.
+static void runLatency(Reporter &reporter, int iterations)
+{
+    static const int Warmup = 10;
+    static const int TimeoutMs = 1000;
+
+    LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application));
+    settings.beginGroup(QLatin1String("latency"));
+    settings.value(QLatin1String("stamp"));
+
+    QProcess writer;
+    writer.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    writer.start(QCoreApplication::applicationFilePath(), QStringList()
+                 << QLatin1String("--no-isolation") << QLatin1String("--latency-writer"));
+    if (!writer.waitForStarted())
+    {
+        qWarning("cannot start the latency writer");
+        return;
+    }
+
+    QEventLoop loop;
+    QTimer timeout;
+    timeout.setSingleShot(true);
+    QObject::connect(&settings, SIGNAL(changed(QString)), &loop, SLOT(quit()));
+    QObject::connect(&timeout, SIGNAL(timeout()), &loop, SLOT(quit()));
+
+    Samples samples;
+    int timeouts = 0;
+    for (int i = 0; i < Warmup + iterations; ++i)
+    {
+        writer.write("w\n");
+        writer.waitForBytesWritten();
+
+        timeout.start(TimeoutMs);
+        loop.exec();
+        qint64 now = monotonicNs();
+        if (!timeout.isActive())
+        {
+            ++timeouts;
+            continue;
+        }
+        timeout.stop();
+
+        qint64 stamp = settings.value(QLatin1String("stamp")).toLongLong();
+        if (i >= Warmup && stamp > 0)
+            samples.add(now - stamp);
+    }
+
+    writer.closeWriteChannel();
+    writer.waitForFinished();
+
+    reporter.report("latency", "lxqt", QLatin1String("write-to-changed"), 1, samples,
+                    QString::fromLatin1("\"timeouts\":%1").arg(timeouts));
+    settings.clear();
+}
+
+static void usage()
+{
+    qWarning("usage: liblxqt-settings-benchmark [--sizes 10,100,...] [--iterations N]\n"
+             "                                  [--suites operations,blobs,codec,keys,threads,latency,soak]\n"
+             "                                  [--soak-ops N] [--backend dconf|memory|ini]\n"
+             "                                  [--output FILE] [--no-isolation]");
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QList<int> sizes;
+    sizes << 10 << 100 << 1000 << 10000 << 100000;
+    int iterations = 1000;
+    QStringList suites;
+    suites << QLatin1String("operations") << QLatin1String("blobs") << QLatin1String("codec") << QLatin1String("keys")
+           << QLatin1String("threads") << QLatin1String("latency");
+    int soakOps = 2000000;
+    QString output;
+    bool isolate = true;
+    bool latencyWriter = false;
+
+    QStringList args = app.arguments();
+    for (int i = 1; i < args.size(); ++i)
+    {
+        const QString &arg = args[i];
+        bool hasValue = i + 1 < args.size();
+        if (arg == QLatin1String("--sizes") && hasValue)
+        {
+            sizes.clear();
+            Q_FOREACH (const QString &size, args[++i].split(QLatin1Char(','), QString::SkipEmptyParts))
+                sizes << qMax(1, size.toInt());
+        }
+        else if (arg == QLatin1String("--iterations") && hasValue)
+        {
+            iterations = qMax(1, args[++i].toInt());
+        }
+        else if (arg == QLatin1String("--suites") && hasValue)
+        {
+            suites = args[++i].split(QLatin1Char(','), QString::SkipEmptyParts);
+        }
+        else if (arg == QLatin1String("--soak-ops") && hasValue)
+        {
+            soakOps = qMax(1, args[++i].toInt());
+        }
+        else if (arg == QLatin1String("--output") && hasValue)
+        {
+            output = args[++i];
+        }
+        else if (arg == QLatin1String("--backend") && hasValue)
+        {
+            // picked up by LxQt::Settings::DefaultBackend
+            qputenv("LXQT_SETTINGS_BACKEND", args[++i].toLatin1());
+        }
+        else if (arg == QLatin1String("--no-isolation"))
+        {
+            isolate = false;
+        }
+        else if (arg == QLatin1String("--latency-writer"))
+        {
+            latencyWriter = true;
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    if (latencyWriter)
+        return runLatencyWriter();
+
+    Isolation isolation;
+    if (isolate && !isolation.start())
+        return 1;
+
+    QFile file;
+    if (output.isEmpty())
+    {
+        file.open(stdout, QIODevice::WriteOnly);
+    }
+    else
+    {
+        file.setFileName(output);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            qWarning("cannot open %s", qPrintable(output));
+            return 1;
+        }
+    }
+
+    Reporter reporter(&file);
+    QByteArray backend = qgetenv("LXQT_SETTINGS_BACKEND");
+    reporter.line(QString::fromLatin1("{\"suite\":\"meta\",\"qt\":\"%1\",\"date\":\"%2\",\"isolated\":%3,\"iterations\":%4,\"lxqt_backend\":\"%5\"}")
+                  .arg(QLatin1String(qVersion()))
+                  .arg(QDateTime::currentDateTime().toString(Qt::ISODate))
+                  .arg(QLatin1String(isolate ? "true" : "false"))
+                  .arg(iterations)
+                  .arg(QLatin1String(backend.isEmpty() ? "dconf" : backend.constData())));
+
+    if (suites.contains(QLatin1String("operations")))
+    {
+        Q_FOREACH (int size, sizes)
+        {
+            {
+                LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application));
+                settings.beginGroup(QLatin1String("operations"));
+                runOperations(reporter, "lxqt", settings, size, iterations);
+            }
+            {
+                QSettings settings(QLatin1String(Organization), QLatin1String(Application));
+                settings.beginGroup(QLatin1String("operations"));
+                runOperations(reporter, "qsettings", settings, size, iterations);
+            }
+        }
+    }
+
+    bool blobsIntact = true;
+    if (suites.contains(QLatin1String("blobs")))
+        blobsIntact = runBlobs(reporter, iterations);
+
+    if (suites.contains(QLatin1String("codec")))
+        runCodec(reporter, iterations);
+
+    if (suites.contains(QLatin1String("keys")))
+        runKeys(reporter, iterations);
+
+    if (suites.contains(QLatin1String("threads")))
+        runThreads(reporter, iterations);
+
+    if (suites.contains(QLatin1String("latency")))
+        runLatency(reporter, iterations);
+
+    int result = 0;
+    if (!blobsIntact)
+        result = 1;
+
+    if (suites.contains(QLatin1String("soak")) && !runSoak(reporter, soakOps))
+    {
+        qWarning("soak: memory kept growing");
+        result = 1;
+    }
+
+    return result;
+}
@@ -19,15 +19,37 @@
 
 #include "liblxqt-settings.h"
 
+#include <QBasicTimer>
 #include <QCoreApplication>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QMetaMethod>
+#include <QMutex>
+#include <QPointer>
+#include <QSet>
 #include <QStack>
-#include <QRegExp>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+#include <QThreadStorage>
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
+#include <QWaitCondition>
 #include <QSize>
 #include <QPoint>
 #include <QRect>
+#include <QTimerEvent>
+#include <QVector>
 
+#include <QVarLengthArray>
 #include <QDebug>
 
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
 extern "C" { // dconf does not do extern "C" properly in its header
 #include <dconf/dconf.h>
 }
@@ -35,439 +57,4485 @@ extern "C" { // dconf does not do extern "C" properly in its header
 namespace LxQt {
 
 static QString variantToString(const QVariant &v);
-static QVariant stringToVariant(const QString &s);
-static QStringList splitArgs(const QString &s, int idx);
-
-class SettingsPrivate
+static QVariant stringToVariant(const char *s, int len);
+static bool parseGeometry(const char *s, int len, int idx, int *args, int count);
+static GVariant *encodeValue(const QVariant &v, Settings::StorageFormat format);
+static QVariant decodeValue(GVariant *value);
+
+// Tracing. LXQT_SETTINGS_TRACE lists the categories to print, e.g.
+// "read,write" or "all". Disabled categories cost one branch and never
+// evaluate their arguments; building with LXQT_SETTINGS_NO_TRACE removes
+// the trace points altogether.
+enum TraceCategory
 {
-    Settings *q_ptr;
-    Q_DECLARE_PUBLIC(Settings)
+    TraceRead = 0x1,
+    TraceWrite = 0x2,
+    TraceGroup = 0x4,
+    TraceNotify = 0x8,
+    TraceAll = 0xf
+};
 
-public:
-    SettingsPrivate(const QString &organization, const QString &application);
-    ~SettingsPrivate();
+static int traceCategories()
+{
+    QByteArray spec = qgetenv("LXQT_SETTINGS_TRACE");
+    int result = 0;
+    Q_FOREACH (const QByteArray &name, spec.split(','))
+    {
+        QByteArray category = name.trimmed();
+        if (category == "all")
+            result |= TraceAll;
+        else if (category == "read")
+            result |= TraceRead;
+        else if (category == "write")
+            result |= TraceWrite;
+        else if (category == "group")
+            result |= TraceGroup;
+        else if (category == "notify")
+            result |= TraceNotify;
+    }
+    return result;
+}
 
-    void clear();
-    void sync();
-    QSettings::Status status() const;
+static const int s_traceCategories = traceCategories();
 
-    void beginGroup(const QString &prefix);
-    void endGroup();
-    QString group() const;
+#ifdef LXQT_SETTINGS_NO_TRACE
+#  define SETTINGS_TRACE_ENABLED(category) false
+#else
+#  define SETTINGS_TRACE_ENABLED(category) ((s_traceCategories & (category)) != 0)
+#endif
 
-    int beginReadArray(const QString& prefix);
-    void beginWriteArray(const QString& prefix);
-    void endArray();
-    void setArrayIndex(int i);
+#define SETTINGS_TRACE(category) \
+    if (!SETTINGS_TRACE_ENABLED(category)) {} else qDebug()
 
-    QStringList allKeys() const;
-    QStringList childKeys() const;
-    QStringList childGroups() const;
-    bool isWritable() const;
+// Tells the owner of a published shard, of a SettingsCache or of the memory
+// backend, when no lookup on another thread can still be reading it. Each
+// thread announces the epoch it entered a lookup in, in a slot of its own,
+// so lookups never write to memory shared with other threads. A replaced shard is tagged with the
+// epoch that followed it and may be freed once every lookup in progress
+// entered at or after that epoch.
+class SettingsReaders
+{
+public:
+    struct Slot
+    {
+        Slot();
+        ~Slot();
 
-    void setValue(const QString &key, const QVariant &value);
-    QVariant value(const QString &key, const QVariant &defaultValue = QVariant()) const;
+        QAtomicInt epoch;   // 0 outside a lookup
+        char padding[64 - sizeof(QAtomicInt)];  // one cache line per thread
+    };
 
-    void remove(const QString &key);
-    bool contains(const QString &key) const;
+    SettingsReaders() : m_epoch(1) {}
 
-    QString organizationName() const;
-    QString applicationName() const;
+    static Slot *enter();
+    static void leave(Slot *slot) { slot->epoch.fetchAndStoreRelease(0); }
+    static int current();
+    static int advance();
+    static int oldest(int current);
+    // epochs wrap around
+    static bool before(int a, int b) { return int(uint(a) - uint(b)) < 0; }
 
 private:
-    DConfClient *m_client;
-    QString m_organizationName;
-    QString m_applicationName;
-    QStringList m_path;
-    QString m_currentPath;
-    QStack<bool> m_groups;
+    friend struct Slot;
 
-    static void c_dconfChanged(DConfClient *client, gchar *prefix, GStrv changes, gchar *tag, gpointer user_data);
-    void dconfChanged(gchar *prefix, GStrv changes, gchar *tag);
-
-    static QString normalisedPath(const QString &path);
-    QStringList allKeys(const char *path, const QString &prefix) const;
+    QAtomicInt m_epoch;
+    QMutex m_mutex;
+    QList<Slot *> m_slots;
 };
 
-SettingsPrivate::SettingsPrivate(const QString &organization, const QString &application)
-    : m_client(0)
-    , m_organizationName(organization)
-    , m_applicationName(application)
+Q_GLOBAL_STATIC(SettingsReaders, readers)
+Q_GLOBAL_STATIC(QThreadStorage<SettingsReaders::Slot *>, readerSlot)
+
+SettingsReaders::Slot::Slot()
+    : epoch(0)
 {
-    m_currentPath = m_organizationName;
-    if (!m_applicationName.isEmpty())
+    if (SettingsReaders *r = readers())
     {
-        m_currentPath += QLatin1String("/") + m_applicationName;
+        QMutexLocker locker(&r->m_mutex);
+        r->m_slots.append(this);
     }
-    m_currentPath = QLatin1String("/") + normalisedPath(m_currentPath);
-    m_path << m_currentPath;
-    m_currentPath += QLatin1Char('/');
-
-// not sure if this condition should be compile-time:
-#if (G_ENCODE_VERSION (GLIB_MAJOR_VERSION, GLIB_MINOR_VERSION)) < GLIB_VERSION_2_36
-    g_type_init();
-#endif
-    m_client = dconf_client_new();
+}
 
-    if (m_client)
+SettingsReaders::Slot::~Slot()
+{
+    if (SettingsReaders *r = readers())
     {
-        g_signal_connect(m_client, "changed", G_CALLBACK(c_dconfChanged), this);
-        dconf_client_watch_fast(m_client, m_currentPath.toLatin1().constData());
+        QMutexLocker locker(&r->m_mutex);
+        r->m_slots.removeOne(this);
     }
 }
 
-SettingsPrivate::~SettingsPrivate()
+SettingsReaders::Slot *SettingsReaders::enter()
 {
-    if (m_client)
+    QThreadStorage<Slot *> *storage = readerSlot();
+    Slot *slot = storage->localData();
+    if (!slot)
     {
-        dconf_client_unwatch_fast(m_client, (m_path[0] + QLatin1Char('/')).toLatin1().constData());
-        g_signal_handlers_disconnect_by_data(m_client, this);
-        g_object_unref(m_client);
+        slot = new Slot;
+        storage->setLocalData(slot);
     }
+
+    // ordered: the shard must not be loaded before we are visible
+    slot->epoch.fetchAndStoreOrdered(current());
+    return slot;
 }
 
-void SettingsPrivate::c_dconfChanged(DConfClient *client, gchar *prefix, GStrv changes, gchar *tag, gpointer user_data)
+int SettingsReaders::current()
 {
-    Q_UNUSED(client);
-    static_cast<SettingsPrivate*>(user_data)->dconfChanged(prefix, changes, tag);
+    SettingsReaders *r = readers();
+    return r ? r->m_epoch.fetchAndAddOrdered(0) : 1;
 }
 
-void SettingsPrivate::dconfChanged(gchar *prefix, GStrv changes, gchar *tag)
+// Starts a new epoch and returns it; 0 is skipped, it marks an idle slot.
+int SettingsReaders::advance()
 {
-    qDebug() << "dconfChanged(), prefix: " << prefix;
-    for (char **change = changes; *change; ++change)
-        qDebug() << "dconfChanged(), change: " << *change;
-    qDebug() << "dconfChanged(), tag: " << tag;
+    SettingsReaders *r = readers();
+    if (!r)
+        return 1;
 
-    if (!m_path.isEmpty())
+    int epoch;
+    int next;
+    do
     {
-        QString qPrefix(prefix);
-        if (qPrefix.length() > m_path[0].length() + 1)
-        {
-            qPrefix = qPrefix.mid(m_path[0].length() + 1);
-            qDebug() << "dconfChanged(), qPrefix: " << qPrefix;
-            Q_Q(Settings);
-            Q_EMIT q->changed(qPrefix);
-        }
+        epoch = r->m_epoch.fetchAndAddOrdered(0);
+        next = int(uint(epoch) + 1) ? int(uint(epoch) + 1) : 1;
     }
+    while (!r->m_epoch.testAndSetOrdered(epoch, next));
+    return next;
 }
 
-QString SettingsPrivate::normalisedPath(const QString &path)
+// The epoch of the oldest lookup in progress, or current if there is none.
+int SettingsReaders::oldest(int current)
 {
-    QString normalisedPrefix = path;
-    static QRegExp rx(QLatin1String("(^/+)|(//+)|(/+$)"));
-    if (normalisedPrefix.indexOf(rx) != -1) // alternative condition: (normalisedPrefix.startsWith(QLatin1Char('/')) || normalisedPrefix.endsWith(QLatin1Char('/')) || (normalisedPrefix.indexOf(QLatin1String("//")) != -1))
-        normalisedPrefix = normalisedPrefix.remove(rx);
-    return normalisedPrefix;
-}
+    SettingsReaders *r = readers();
+    if (!r)
+        return current;
 
-void SettingsPrivate::clear()
-{
-    qDebug() << "clear(), path: " << m_currentPath;
-    dconf_client_write_sync(m_client, m_currentPath.toLatin1().constData(), NULL, NULL, NULL, NULL);
+    QMutexLocker locker(&r->m_mutex);
+    Q_FOREACH (Slot *slot, r->m_slots)
+    {
+        int epoch = slot->epoch.fetchAndAddOrdered(0);
+        if (epoch && before(epoch, current))
+            current = epoch;
+    }
+    return current;
 }
 
-void SettingsPrivate::sync()
+// A value read from the backend by SettingsPrivate::lookupMany().
+struct SettingsRead
 {
-    dconf_client_sync(m_client);
-}
+    QString key;
+    QByteArray path;
+    bool exists;
+    QVariant value;
+    gsize size;
+};
 
-QSettings::Status SettingsPrivate::status() const
+// Decoded values keyed by absolute dconf path. Entries are filled on first
+// read, updated by our own writes and dropped when dconf reports a change.
+//
+// The owning thread is the only writer and works on plain hashes, split in
+// shards. Other threads read immutable copies of the shards, republished in
+// batches from the event loop, or right away once enough changes piled up;
+// a shard changed since it was published is skipped. Their fills are queued
+// and applied by the owning thread, unless something changed in between.
+// Replaced shards are freed once no lookup can still be reading them, see
+// SettingsReaders.
+class SettingsCache
 {
-    return QSettings::NoError; // FIXME: should we omit errors?
-}
+public:
+    explicit SettingsCache(QObject *owner);
+    ~SettingsCache();
+
+    // owning thread only
+    bool lookup(const QByteArray &path, bool *exists, QVariant *value, bool *prefetched = 0);
+    void insert(const QByteArray &path, bool exists, const QVariant &value);
+    void fill(const QByteArray &path, bool exists, const QVariant &value);
+    void fill(const QVector<SettingsRead> &reads);
+    void invalidate(const QByteArray &path);
+    void invalidatePrefix(const QByteArray &prefix);
+    void publish();
+
+    // any thread
+    bool find(const QByteArray &path, bool *exists, QVariant *value) const;
+    // Queues a fill read from the backend after generation() returned
+    // generation; it is dropped if the owning thread changed anything since.
+    void submit(const QByteArray &path, bool exists, const QVariant &value, int generation);
+    void submit(const QVector<SettingsRead> &reads, int generation, bool prefetched);
+    int generation() const { return m_generation.fetchAndAddOrdered(0); }
+
+    quint64 hits() const { return m_hits; }
+    quint64 misses() const { return m_misses; }
 
-void SettingsPrivate::beginGroup(const QString &prefix)
-{
-    QString path = normalisedPath(prefix);
+private:
+    class Publisher;
 
-    m_path += path;
-    m_currentPath = m_path.join(QLatin1String("/")) + QLatin1Char('/');
-    m_groups.push(true);
+    struct Entry
+    {
+        bool exists;
+        bool prefetched;    // put there by the background prefetch
+        QVariant value;
+    };
 
-    qDebug() << "beginGroup, m_currentPath: " << m_currentPath;
-}
+    struct Fill
+    {
+        QByteArray path;
+        Entry entry;
+        int generation;
+    };
 
-void SettingsPrivate::endGroup()
+    typedef QHash<QByteArray, Entry> Shard;
+
+    struct Retired
+    {
+        Shard *shard;
+        int epoch;
+    };
+
+    enum
+    {
+        ShardCount = 64,
+        // changes that make publish() run before the event loop gets to it
+        PublishBatch = 256,
+        // replaced shards kept for lookups in progress before publish() waits
+        MaxRetired = 4 * ShardCount
+    };
+
+    static int shardOf(const QByteArray &path) { return qHash(path) % ShardCount; }
+    void store(const QByteArray &path, const Entry &entry);
+    void changed(int shard, bool stale);
+    void schedulePublish();
+    void drainFills();
+    void reclaim();
+
+    Shard m_local[ShardCount];
+    int m_size;
+    quint64 m_dirty;    // shards changed since they were published
+    int m_changes;
+    mutable QAtomicPointer<Shard> m_published[ShardCount];
+    mutable QAtomicInt m_stale[ShardCount];    // changed since published
+    QList<Retired> m_retired;
+    mutable QAtomicInt m_generation;
+
+    QMutex m_fillMutex;
+    QVector<Fill> m_fills;
+    QAtomicInt m_fillsPending;
+    QAtomicInt m_publishPosted;
+    Publisher *m_publisher;
+
+    quint64 m_hits;
+    quint64 m_misses;
+};
+
+// Runs publish() from the event loop of the owning thread.
+class SettingsCache::Publisher : public QObject
 {
-    if (m_groups.isEmpty())
+public:
+    Publisher(SettingsCache *cache, QObject *owner)
+        : QObject(owner)
+        , m_cache(cache)
     {
-        qWarning() << "endGroup() called with no groups";
-        return;
     }
 
-    if (!m_groups.top())
+    static QEvent::Type publishType()
     {
-        qWarning() << "endGroup() called on an array";
-        return;
+        static QEvent::Type type = QEvent::Type(QEvent::registerEventType());
+        return type;
     }
 
-    if (m_path.length() <= 1)
+    bool event(QEvent *event)
     {
-        qWarning() << "endArray() called on a corrupted path";
-        return;
+        if (event->type() != publishType())
+            return QObject::event(event);
+
+        m_cache->m_publishPosted.fetchAndStoreOrdered(0);
+        m_cache->publish();
+        return true;
     }
 
-    m_path.removeLast();
-    m_currentPath = m_path.join(QLatin1String("/")) + QLatin1Char('/');
-    m_groups.pop();
+private:
+    SettingsCache *m_cache;
+};
 
-    qDebug() << "endGroup, m_currentPath: " << m_currentPath;
+SettingsCache::SettingsCache(QObject *owner)
+    : m_size(0)
+    , m_dirty(0)
+    , m_changes(0)
+    , m_generation(0)
+    , m_fillsPending(0)
+    , m_publishPosted(0)
+    , m_publisher(new Publisher(this, owner))
+    , m_hits(0)
+    , m_misses(0)
+{
+    for (int i = 0; i < ShardCount; ++i)
+    {
+        m_published[i] = new Shard;
+        m_stale[i] = 0;
+    }
 }
 
-QString SettingsPrivate::group() const
+SettingsCache::~SettingsCache()
 {
-    return QStringList(m_path.mid(1)).join(QLatin1String("/"));
+    delete m_publisher;
+    Q_FOREACH (const Retired &retired, m_retired)
+        delete retired.shard;
+    for (int i = 0; i < ShardCount; ++i)
+        delete static_cast<Shard *>(m_published[i]);
 }
 
-int SettingsPrivate::beginReadArray(const QString &prefix)
+// Counts hits and misses.
+bool SettingsCache::lookup(const QByteArray &path, bool *exists, QVariant *value, bool *prefetched)
 {
-    QString path = normalisedPath(prefix);
-
-    m_path += path;
-
-    int result = 0;
-    Q_FOREACH (QString group, childGroups())
+    const Shard &entries = m_local[shardOf(path)];
+    Shard::const_iterator it = entries.constFind(path);
+    if (it == entries.constEnd() && m_fillsPending.fetchAndAddAcquire(0))
     {
-        bool ok;
-        int index = group.toInt(&ok);
-        if (ok)
-            result = index + 1;
+        drainFills();
+        it = entries.constFind(path);
     }
 
-    m_path += QLatin1String("0");
-    m_currentPath = m_path.join(QLatin1String("/")) + QLatin1Char('/');
-    m_groups.push(false);
-
-    qDebug() << "beginReadArray, m_currentPath: " << m_currentPath;
+    if (it == entries.constEnd())
+    {
+        ++m_misses;
+        return false;
+    }
 
-    return result;
+    ++m_hits;
+    *exists = it.value().exists;
+    *value = it.value().value;
+    if (prefetched)
+        *prefetched = it.value().prefetched;
+    return true;
 }
 
-void SettingsPrivate::beginWriteArray(const QString &prefix)
+// Our own write: replaces what other threads see.
+void SettingsCache::insert(const QByteArray &path, bool exists, const QVariant &value)
 {
-    QString path = normalisedPath(prefix);
-
-    m_path += path;
-    m_path += QLatin1String("0");
-    m_currentPath = m_path.join(QLatin1String("/")) + QLatin1Char('/');
-    m_groups.push(false);
+    Entry entry;
+    entry.exists = exists;
+    entry.prefetched = false;
+    entry.value = value;
+    store(path, entry);
+    changed(shardOf(path), true);
+    schedulePublish();
+}
 
-    qDebug() << "beginWriteArray, m_currentPath: " << m_currentPath;
+// A value just read from the backend.
+void SettingsCache::fill(const QByteArray &path, bool exists, const QVariant &value)
+{
+    Entry entry;
+    entry.exists = exists;
+    entry.prefetched = false;
+    entry.value = value;
+    store(path, entry);
+    changed(shardOf(path), false);
+    schedulePublish();
 }
 
-void SettingsPrivate::endArray()
+void SettingsCache::fill(const QVector<SettingsRead> &reads)
 {
-    if (m_groups.isEmpty())
+    Entry entry;
+    entry.prefetched = false;
+    Q_FOREACH (const SettingsRead &read, reads)
     {
-        qWarning() << "endArray() called with no arrays";
-        return;
+        entry.exists = read.exists;
+        entry.value = read.value;
+        store(read.path, entry);
+        changed(shardOf(read.path), false);
     }
+    schedulePublish();
+}
 
-    if (!m_groups.top())
+void SettingsCache::invalidate(const QByteArray &path)
+{
+    int shard = shardOf(path);
+    if (m_local[shard].remove(path))
     {
-        qWarning() << "endArray() called on a group";
-        return;
+        --m_size;
+        changed(shard, true);
+        schedulePublish();
     }
-
-    if (m_path.length() <= 2)
+    else
     {
-        qWarning() << "endArray() called on a corrupted path";
-        return;
+        // a fill read before this change must not enter the cache
+        m_generation.ref();
     }
+}
 
-    m_path.removeLast();
-    m_path.removeLast();
-    m_currentPath = m_path.join(QLatin1String("/")) + QLatin1Char('/');
-    m_groups.pop();
+void SettingsCache::invalidatePrefix(const QByteArray &prefix)
+{
+    for (int i = 0; i < ShardCount; ++i)
+    {
+        // only detach the shards that hold a matching path
+        Shard &entries = m_local[i];
+        bool matched = false;
+        for (Shard::const_iterator it = entries.constBegin(); !matched && it != entries.constEnd(); ++it)
+            matched = it.key().startsWith(prefix);
+        if (!matched)
+            continue;
+
+        Shard::iterator it = entries.begin();
+        while (it != entries.end())
+        {
+            if (it.key().startsWith(prefix))
+            {
+                it = entries.erase(it);
+                --m_size;
+                changed(i, true);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    m_generation.ref();
+    schedulePublish();
+}
 
-    qDebug() << "endGroup, m_currentPath: " << m_currentPath;
+void SettingsCache::store(const QByteArray &path, const Entry &entry)
+{
+    Shard &entries = m_local[shardOf(path)];
+    int size = entries.size();
+    entries.insert(path, entry);
+    m_size += entries.size() - size;
 }
 
-void SettingsPrivate::setArrayIndex(int i)
+void SettingsCache::changed(int shard, bool stale)
 {
-    if (m_groups.isEmpty())
+    if (stale)
     {
-        qWarning() << "setArrayIndex() called with no arrays";
-        return;
+        m_generation.ref();
+        m_stale[shard].fetchAndStoreRelease(1);
     }
+    m_dirty |= Q_UINT64_C(1) << shard;
+    ++m_changes;
+}
+
+void SettingsCache::schedulePublish()
+{
+    if (m_changes >= qMax<int>(PublishBatch, m_size / 4))
+        publish();
+    else if (m_dirty && m_publishPosted.testAndSetOrdered(0, 1))
+        QCoreApplication::postEvent(m_publisher, new QEvent(Publisher::publishType()));
+}
 
-    if (!m_groups.top())
+// Makes every change so far visible to other threads.
+void SettingsCache::publish()
+{
+    drainFills();
+    if (m_dirty)
     {
-        qWarning() << "setArrayIndex() called on a group";
-        return;
+        int first = m_retired.size();
+        for (int i = 0; i < ShardCount; ++i)
+        {
+            if (!(m_dirty & (Q_UINT64_C(1) << i)))
+                continue;
+            // shares the data with m_local[i] until we change that again
+            Retired retired;
+            retired.shard = m_published[i].fetchAndStoreOrdered(new Shard(m_local[i]));
+            m_retired.append(retired);
+        }
+
+        // lookups from now on see the new shards
+        int epoch = SettingsReaders::advance();
+        for (int i = first; i < m_retired.size(); ++i)
+            m_retired[i].epoch = epoch;
+        for (int i = 0; i < ShardCount; ++i)
+        {
+            if (m_dirty & (Q_UINT64_C(1) << i))
+                m_stale[i].fetchAndStoreRelease(0);
+        }
+        m_dirty = 0;
+        m_changes = 0;
     }
 
-    if (m_path.length() <= 2)
+    reclaim();
+    while (m_retired.size() > MaxRetired)
     {
-        qWarning() << "setArrayIndex() called on a corrupted path";
-        return;
+        QThread::yieldCurrentThread();
+        reclaim();
     }
+}
 
-    m_path.removeLast();
-    m_path += QString::number(i);
-    m_currentPath = m_path.join(QLatin1String("/")) + QLatin1Char('/');
+void SettingsCache::reclaim()
+{
+    if (m_retired.isEmpty())
+        return;
 
-    qDebug() << "endGroup, m_currentPath: " << m_currentPath;
+    int oldest = SettingsReaders::oldest(SettingsReaders::current());
+    while (!m_retired.isEmpty() && !SettingsReaders::before(oldest, m_retired.first().epoch))
+        delete m_retired.takeFirst().shard;
 }
 
-QStringList SettingsPrivate::allKeys() const
+void SettingsCache::drainFills()
 {
-    dconf_client_sync(m_client);
-
-    QString prefix = group();
-    if (!prefix.isEmpty())
+    QVector<Fill> fills;
+    m_fillMutex.lock();
+    qSwap(fills, m_fills);
+    m_fillsPending.fetchAndStoreRelaxed(0);
+    m_fillMutex.unlock();
+
+    int current = generation();
+    Q_FOREACH (const Fill &fill, fills)
     {
-        prefix += QLatin1Char('/');
+        int shard = shardOf(fill.path);
+        if (fill.generation != current || m_local[shard].contains(fill.path))
+            continue;
+        store(fill.path, fill.entry);
+        changed(shard, false);
     }
-    return allKeys(m_currentPath.toLatin1().constData(), prefix);
 }
 
-QStringList SettingsPrivate::allKeys(const char *path, const QString &prefix) const
+bool SettingsCache::find(const QByteArray &path, bool *exists, QVariant *value) const
 {
-    QStringList result;
-
-    char **keys = dconf_client_list(m_client, path, NULL);
+    int shard = shardOf(path);
+    SettingsReaders::Slot *slot = SettingsReaders::enter();
 
-    if (keys)
+    bool found = false;
+    if (!m_stale[shard].fetchAndAddAcquire(0))
     {
-        for (char **key = keys; *key; ++key)
+        const Shard *entries = m_published[shard].fetchAndAddAcquire(0);
+        Shard::const_iterator it = entries->constFind(path);
+        found = it != entries->constEnd();
+        if (found)
         {
-            if (dconf_is_rel_dir(*key, NULL))
-            {
-                result += allKeys((QString(path) + *key).toLatin1().constData(), prefix + *key);
-            }
-            else if (dconf_is_rel_key(*key, NULL))
-            {
-                result += prefix + *key;
-            }
+            *exists = it.value().exists;
+            *value = it.value().value;
         }
-
-        g_strfreev(keys);
     }
 
-    return result;
+    SettingsReaders::leave(slot);
+    return found;
 }
 
-QStringList SettingsPrivate::childKeys() const
+void SettingsCache::submit(const QByteArray &path, bool exists, const QVariant &value, int generation)
+{
+    Fill fill;
+    fill.path = path;
+    fill.entry.exists = exists;
+    fill.entry.prefetched = false;
+    fill.entry.value = value;
+    fill.generation = generation;
+
+    m_fillMutex.lock();
+    m_fills.append(fill);
+    m_fillsPending.fetchAndStoreRelease(1);
+    m_fillMutex.unlock();
+
+    if (m_publishPosted.testAndSetOrdered(0, 1))
+        QCoreApplication::postEvent(m_publisher, new QEvent(Publisher::publishType()));
+}
+
+void SettingsCache::submit(const QVector<SettingsRead> &reads, int generation, bool prefetched)
 {
-    dconf_client_sync(m_client);
+    if (reads.isEmpty())
+        return;
 
-    QStringList result;
+    m_fillMutex.lock();
+    Q_FOREACH (const SettingsRead &read, reads)
+    {
+        Fill fill;
+        fill.path = read.path;
+        fill.entry.exists = read.exists;
+        fill.entry.prefetched = prefetched;
+        fill.entry.value = read.value;
+        fill.generation = generation;
+        m_fills.append(fill);
+    }
+    m_fillsPending.fetchAndStoreRelease(1);
+    m_fillMutex.unlock();
+
+    if (m_publishPosted.testAndSetOrdered(0, 1))
+        QCoreApplication::postEvent(m_publisher, new QEvent(Publisher::publishType()));
+}
 
-    char **keys = dconf_client_list(m_client, m_currentPath.toLatin1().constData(), NULL);
+// Owns a GVariant reference; copies share the value, like a Qt value type.
+// The constructor takes over a reference, sinking a floating one, as
+// returned by the backends' read() and by encodeValue(); ref() adds one to
+// a borrowed value.
+class GVariantPtr
+{
+public:
+    GVariantPtr() : m_value(NULL) {}
+    explicit GVariantPtr(GVariant *value) : m_value(value ? g_variant_take_ref(value) : NULL) {}
+    GVariantPtr(const GVariantPtr &other) : m_value(other.m_value ? g_variant_ref(other.m_value) : NULL) {}
+    ~GVariantPtr() { if (m_value) g_variant_unref(m_value); }
 
-    if (keys)
+    static GVariantPtr ref(GVariant *value) { return GVariantPtr(value ? g_variant_ref_sink(value) : NULL); }
+
+    GVariantPtr &operator=(const GVariantPtr &other)
     {
-        for (char **key = keys; *key; ++key)
-        {
-            if (dconf_is_rel_key(*key, NULL))
-            {
-                result += *key;
-            }
-        }
+        GVariantPtr copy(other);
+        qSwap(m_value, copy.m_value);
+        return *this;
+    }
+
+    GVariant *get() const { return m_value; }
+    bool isNull() const { return !m_value; }
+    gsize size() const { return m_value ? g_variant_get_size(m_value) : 0; }
+
+private:
+    GVariant *m_value;
+};
 
-        g_strfreev(keys);
+// Owns the error a GLib call reports through out().
+class GErrorPtr
+{
+public:
+    GErrorPtr() : m_error(NULL) {}
+    ~GErrorPtr() { reset(); }
+
+    GError **out() { reset(); return &m_error; }
+    bool isSet() const { return m_error; }
+    const char *message() const { return m_error ? m_error->message : ""; }
+
+private:
+    Q_DISABLE_COPY(GErrorPtr)
+
+    void reset()
+    {
+        if (m_error)
+            g_error_free(m_error);
+        m_error = NULL;
     }
 
-    return result;
-}
+    GError *m_error;
+};
 
-QStringList SettingsPrivate::childGroups() const
+// Owns a NULL terminated string array, as the backends' list() returns.
+class GStrvPtr
 {
-    dconf_client_sync(m_client);
+public:
+    // the end is found once, loops call end() on every iteration
+    explicit GStrvPtr(gchar **strv) : m_strv(strv), m_end(strv ? strv + g_strv_length(strv) : NULL) {}
+    ~GStrvPtr() { g_strfreev(m_strv); }
 
-    QStringList result;
+    gchar **begin() const { return m_strv; }
+    gchar **end() const { return m_end; }
+
+private:
+    Q_DISABLE_COPY(GStrvPtr)
+
+    gchar **m_strv;
+    gchar **m_end;
+};
+
+// Receives the changes a backend reports, as dconf's "changed" signal does:
+// the changed keys or directories are prefix + each of changes. tag is the
+// one dconf gave the write that made the change, NULL for backends without
+// tags.
+class SettingsBackendListener
+{
+public:
+    virtual ~SettingsBackendListener() {}
+    virtual void backendChanged(const char *prefix, const char * const *changes, const char *tag) = 0;
+};
+
+// Where settings are stored. Paths are absolute dconf paths and values the
+// GVariants encodeValue() produces. Backends are process-wide and shared by
+// all Settings objects using them; apart from the listeners, which are
+// called in the thread that added them, they may be used from any thread.
+class SettingsBackend
+{
+public:
+    virtual ~SettingsBackend() {}
+
+    static SettingsBackend *instance(Settings::Backend backend);
+    static Settings::Backend resolve(Settings::Backend backend);
+
+    virtual GVariant *read(const QByteArray &path) = 0;     // a new reference, or NULL
+    virtual gchar **list(const QByteArray &dir) = 0;        // free with g_strfreev()
+    // Resets path, and everything below it when it ends with '/', if value
+    // is NULL. Only resets are written synchronously. tag is set to the tag
+    // the change will be reported with, when the backend knows it already.
+    virtual bool write(const QByteArray &path, GVariant *value, QByteArray *tag, GError **error) = 0;
+    virtual bool change(DConfChangeset *changeset, QByteArray *tag, GError **error) = 0;
+    // change() that returns once the change is stored
+    virtual bool changeSync(DConfChangeset *changeset, QByteArray *tag, GError **error) = 0;
+    virtual void sync() = 0;
+    virtual bool isWritable(const QByteArray &path) = 0;
+
+    virtual void watch(const QByteArray &dir) = 0;
+    virtual void unwatch(const QByteArray &dir) = 0;
+    virtual void addListener(SettingsBackendListener *listener) = 0;
+    virtual void removeListener(SettingsBackendListener *listener) = 0;
+};
+
+// Delivers the changes of a backend to each listener from the event loop
+// of the thread that added it, whichever thread reports them. Changes
+// reported before that thread gets to them are delivered in one go.
+class SettingsNotifier
+{
+public:
+    ~SettingsNotifier();
 
-    char **keys = dconf_client_list(m_client, m_currentPath.toLatin1().constData(), NULL);
+    void addListener(SettingsBackendListener *listener);
+    void removeListener(SettingsBackendListener *listener);
+    // tag is passed on as NULL when it is a null QByteArray
+    void notify(const QByteArray &prefix, const QList<QByteArray> &changes, const QByteArray &tag);
 
-    if (keys)
+private:
+    struct Change
     {
-        for (char **key = keys; *key; ++key)
-        {
-            if (dconf_is_rel_dir(*key, NULL))
-            {
-                result += *key;
-            }
-        }
+        QByteArray prefix;
+        QList<QByteArray> changes;
+        QByteArray tag;
+    };
 
-        g_strfreev(keys);
-    }
+    // one per listening thread, living in it
+    class Dispatcher : public QObject
+    {
+    public:
+        explicit Dispatcher(SettingsNotifier *notifier) : m_notifier(notifier) {}
 
-    return result;
+        bool event(QEvent *event);
+
+        static QEvent::Type dispatchType();
+
+        SettingsNotifier *m_notifier;
+        QList<SettingsBackendListener *> listeners;  // guarded by the notifier
+        QList<Change> queue;                         // guarded by the notifier
+    };
+
+    QMutex m_mutex;
+    QHash<QThread *, Dispatcher *> m_dispatchers;
+};
+
+SettingsNotifier::~SettingsNotifier()
+{
+    qDeleteAll(m_dispatchers);
 }
 
-bool SettingsPrivate::isWritable() const
+QEvent::Type SettingsNotifier::Dispatcher::dispatchType()
 {
-    return bool(dconf_client_is_writable(m_client, m_currentPath.toLatin1().constData()));
+    static QEvent::Type type = QEvent::Type(QEvent::registerEventType());
+    return type;
 }
 
-void SettingsPrivate::setValue(const QString &key, const QVariant &value)
+void SettingsNotifier::addListener(SettingsBackendListener *listener)
 {
-    GError *err = NULL;
-    QString str = variantToString(value);
-    QString path = m_currentPath + normalisedPath(key);
-    GVariant *val = g_variant_new_string(str.toUtf8().constData());
-    g_variant_ref_sink(val);
-    qDebug() << "setValue: path: " << path << ", value: " << g_variant_get_string(val, NULL);
-    dconf_client_write_fast(m_client, path.toLatin1().constData(), val, &err);
-    if (val)
+    QMutexLocker locker(&m_mutex);
+    Dispatcher *&dispatcher = m_dispatchers[QThread::currentThread()];
+    if (!dispatcher)
+        dispatcher = new Dispatcher(this);
+    dispatcher->listeners += listener;
+}
+
+void SettingsNotifier::removeListener(SettingsBackendListener *listener)
+{
+    Dispatcher *unused = 0;
     {
-        g_variant_unref(val);
+        QMutexLocker locker(&m_mutex);
+        QHash<QThread *, Dispatcher *>::iterator it;
+        for (it = m_dispatchers.begin(); it != m_dispatchers.end(); ++it)
+        {
+            if (it.value()->listeners.removeOne(listener))
+                break;
+        }
+        if (it == m_dispatchers.end() || !it.value()->listeners.isEmpty())
+            return;
+
+        unused = it.value();
+        m_dispatchers.erase(it);
     }
 
-    if (err)
+    // it may be dispatching right now, in this very thread
+    unused->deleteLater();
+}
+
+void SettingsNotifier::notify(const QByteArray &prefix, const QList<QByteArray> &changes, const QByteArray &tag)
+{
+    Change change;
+    change.prefix = prefix;
+    change.changes = changes;
+    change.tag = tag;
+
+    QMutexLocker locker(&m_mutex);
+    Q_FOREACH (Dispatcher *dispatcher, m_dispatchers)
     {
-        qDebug() << "error: " << err->message;
-        g_error_free(err);
+        dispatcher->queue += change;
+        if (dispatcher->queue.size() == 1)
+            QCoreApplication::postEvent(dispatcher, new QEvent(Dispatcher::dispatchType()));
     }
 }
 
-QVariant SettingsPrivate::value(const QString &key, const QVariant &defaultValue) const
+bool SettingsNotifier::Dispatcher::event(QEvent *event)
 {
-    dconf_client_sync(m_client);
+    if (event->type() != dispatchType())
+        return QObject::event(event);
+
+    m_notifier->m_mutex.lock();
+    QList<Change> changes;
+    qSwap(changes, queue);
+    QList<SettingsBackendListener *> targets = listeners;
+    m_notifier->m_mutex.unlock();
 
-    QString path = m_currentPath + normalisedPath(key);
-    qDebug() << "value(), path: " << path;
-    GVariant *val = dconf_client_read(m_client, path.toLatin1().constData());
-    if (val)
+    Q_FOREACH (const Change &change, changes)
     {
-        const char *str = g_variant_get_string(val, NULL);
-        if (str)
+        QVarLengthArray<const char *, 16> paths;
+        Q_FOREACH (const QByteArray &path, change.changes)
+            paths.append(path.constData());
+        paths.append(NULL);
+
+        const char *tag = change.tag.isNull() ? NULL : change.tag.constData();
+        Q_FOREACH (SettingsBackendListener *listener, targets)
         {
-            QVariant qv = stringToVariant(str);
-            // g_variant_unref(val);
-            return qv;
+            // an earlier listener may have removed, even deleted, it
+            m_notifier->m_mutex.lock();
+            bool registered = listeners.contains(listener);
+            m_notifier->m_mutex.unlock();
+            if (registered)
+                listener->backendChanged(change.prefix.constData(), paths.constData(), tag);
         }
-        // g_variant_unref(val);
     }
-    return defaultValue;
+    return true;
 }
 
-void SettingsPrivate::remove(const QString &key)
+// Runs a GMainContext of its own for dconf's "changed" signal, which a
+// client emits in the thread-default context it was created in. Change
+// delivery so neither depends on Qt using the GLib event dispatcher nor
+// on the listeners' threads being idle.
+class DConfWatchThread : public QThread
 {
-    QString path = m_currentPath + normalisedPath(key);
-    qDebug() << "remove(), path: " << path;
-    dconf_client_write_sync(m_client, path.toLatin1().constData(), NULL, NULL, NULL, NULL);
-}
+public:
+    explicit DConfWatchThread(SettingsNotifier *notifier);
 
-bool SettingsPrivate::contains(const QString &key) const
-{
-    dconf_client_sync(m_client);
+    // blocks until the client exists; NULL if it could not be created
+    DConfClient *startWatching();
+    void stopWatching();
 
-    QString path = m_currentPath + normalisedPath(key);
-    qDebug() << "contains(), path: " << path;
-    return dconf_client_read(m_client, path.toLatin1().constData()) != NULL;
-}
+protected:
+    void run();
 
-QString SettingsPrivate::organizationName() const
+private:
+    static void c_changed(DConfClient *client, gchar *prefix, GStrv changes, gchar *tag, gpointer user_data);
+
+    SettingsNotifier *m_notifier;
+    DConfClient *m_client;
+    GMainLoop *m_loop;
+    QMutex m_mutex;
+    QWaitCondition m_started;
+};
+
+DConfWatchThread::DConfWatchThread(SettingsNotifier *notifier)
+    : m_notifier(notifier)
+    , m_client(NULL)
+    , m_loop(NULL)
+{
+}
+
+DConfClient *DConfWatchThread::startWatching()
+{
+    QMutexLocker locker(&m_mutex);
+    QThread::start();
+    m_started.wait(&m_mutex);
+    return m_client;
+}
+
+void DConfWatchThread::stopWatching()
+{
+    if (!m_loop)
+        return;
+
+    g_main_loop_quit(m_loop);
+    wait();
+    g_main_loop_unref(m_loop);
+    m_loop = NULL;
+}
+
+void DConfWatchThread::run()
+{
+    GMainContext *context = g_main_context_new();
+    g_main_context_push_thread_default(context);
+
+    m_mutex.lock();
+    m_client = dconf_client_new();
+    if (m_client)
+        g_signal_connect(m_client, "changed", G_CALLBACK(c_changed), m_notifier);
+    m_loop = g_main_loop_new(context, FALSE);
+    m_started.wakeAll();
+    m_mutex.unlock();
+
+    if (m_client)
+        g_main_loop_run(m_loop);
+
+    if (m_client)
+    {
+        g_signal_handlers_disconnect_by_data(m_client, m_notifier);
+        g_object_unref(m_client);
+    }
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+}
+
+void DConfWatchThread::c_changed(DConfClient *client, gchar *prefix, GStrv changes, gchar *tag, gpointer user_data)
+{
+    Q_UNUSED(client);
+    QList<QByteArray> paths;
+    for (gchar **change = changes; change && *change; ++change)
+        paths += QByteArray(*change);
+    static_cast<SettingsNotifier *>(user_data)->notify(prefix, paths, tag);
+}
+
+// dconf. Creating a client and adding a D-Bus match rule is expensive, so
+// there is one client for the process, and one watch per path however many
+// Settings objects watch it. The watches live on a second client owned by
+// the watch thread.
+class DConfSettingsBackend : public SettingsBackend
+{
+public:
+    DConfSettingsBackend();
+    ~DConfSettingsBackend();
+
+    GVariant *read(const QByteArray &path);
+    gchar **list(const QByteArray &dir);
+    bool write(const QByteArray &path, GVariant *value, QByteArray *tag, GError **error);
+    bool change(DConfChangeset *changeset, QByteArray *tag, GError **error);
+    bool changeSync(DConfChangeset *changeset, QByteArray *tag, GError **error);
+    void sync();
+    bool isWritable(const QByteArray &path);
+
+    void watch(const QByteArray &dir);
+    void unwatch(const QByteArray &dir);
+    void addListener(SettingsBackendListener *listener) { m_notifier.addListener(listener); }
+    void removeListener(SettingsBackendListener *listener) { m_notifier.removeListener(listener); }
+
+private:
+    QMutex m_mutex;
+    DConfClient *m_client;
+    SettingsNotifier m_notifier;
+    DConfWatchThread m_watchThread;
+    DConfClient *m_watchClient;
+    QHash<QByteArray, int> m_watches;
+};
+
+DConfSettingsBackend::DConfSettingsBackend()
+    : m_watchThread(&m_notifier)
+{
+// not sure if this condition should be compile-time:
+#if (G_ENCODE_VERSION (GLIB_MAJOR_VERSION, GLIB_MINOR_VERSION)) < GLIB_VERSION_2_36
+    g_type_init();
+#endif
+    m_client = dconf_client_new();
+    m_watchClient = m_watchThread.startWatching();
+}
+
+DConfSettingsBackend::~DConfSettingsBackend()
+{
+    m_watchThread.stopWatching();
+    if (m_client)
+        g_object_unref(m_client);
+}
+
+GVariant *DConfSettingsBackend::read(const QByteArray &path)
+{
+    return m_client ? dconf_client_read(m_client, path.constData()) : NULL;
+}
+
+gchar **DConfSettingsBackend::list(const QByteArray &dir)
+{
+    return m_client ? dconf_client_list(m_client, dir.constData(), NULL) : NULL;
+}
+
+// Only the synchronous calls tell the tag of the change they made.
+bool DConfSettingsBackend::write(const QByteArray &path, GVariant *value, QByteArray *tag, GError **error)
+{
+    if (!m_client)
+        return false;
+
+    if (value)
+        return dconf_client_write_fast(m_client, path.constData(), value, error);
+
+    gchar *written = NULL;
+    bool ok = dconf_client_write_sync(m_client, path.constData(), NULL, &written, NULL, error);
+    if (tag)
+        *tag = QByteArray(written);
+    g_free(written);
+    return ok;
+}
+
+bool DConfSettingsBackend::change(DConfChangeset *changeset, QByteArray *tag, GError **error)
+{
+    Q_UNUSED(tag);
+    return m_client && dconf_client_change_fast(m_client, changeset, error);
+}
+
+bool DConfSettingsBackend::changeSync(DConfChangeset *changeset, QByteArray *tag, GError **error)
+{
+    if (!m_client)
+        return false;
+
+    gchar *written = NULL;
+    bool ok = dconf_client_change_sync(m_client, changeset, &written, NULL, error);
+    if (tag)
+        *tag = QByteArray(written);
+    g_free(written);
+    return ok;
+}
+
+void DConfSettingsBackend::sync()
+{
+    if (m_client)
+        dconf_client_sync(m_client);
+}
+
+bool DConfSettingsBackend::isWritable(const QByteArray &path)
+{
+    return m_client && dconf_client_is_writable(m_client, path.constData());
+}
+
+void DConfSettingsBackend::watch(const QByteArray &dir)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_watchClient && m_watches[dir]++ == 0)
+        dconf_client_watch_fast(m_watchClient, dir.constData());
+}
+
+void DConfSettingsBackend::unwatch(const QByteArray &dir)
+{
+    QMutexLocker locker(&m_mutex);
+    QHash<QByteArray, int>::iterator it = m_watches.find(dir);
+    if (it == m_watches.end())
+        return;
+
+    if (--it.value() == 0)
+    {
+        m_watches.erase(it);
+        dconf_client_unwatch_fast(m_watchClient, dir.constData());
+    }
+}
+
+// Base of the backends that live in this process. Like dconf, they report
+// changes from the event loop of the listeners' threads, never from within
+// the write.
+class LocalSettingsBackend : public SettingsBackend
+{
+public:
+    void watch(const QByteArray &) {}
+    void unwatch(const QByteArray &) {}
+    void addListener(SettingsBackendListener *listener) { m_notifier.addListener(listener); }
+    void removeListener(SettingsBackendListener *listener) { m_notifier.removeListener(listener); }
+    // changes are stored at once
+    bool changeSync(DConfChangeset *changeset, QByteArray *tag, GError **error)
+    {
+        return change(changeset, tag, error);
+    }
+
+protected:
+    // returns the tag the change is reported with
+    QByteArray notify(const QByteArray &prefix, const QList<QByteArray> &changes)
+    {
+        QByteArray tag = "local:" + QByteArray::number(m_tags.fetchAndAddOrdered(1));
+        m_notifier.notify(prefix, changes, tag);
+        return tag;
+    }
+
+private:
+    SettingsNotifier m_notifier;
+    QAtomicInt m_tags;
+};
+
+// Everything in memory and gone at exit: for tests and benchmarks that
+// should measure the settings layer rather than IPC. Changes are serialised
+// by a mutex and republish the shards they touched; read() looks values up
+// in the published shards without locking, like SettingsCache::find(). A
+// directory index keeps list() to the directory listed.
+class MemorySettingsBackend : public LocalSettingsBackend
+{
+public:
+    MemorySettingsBackend();
+    ~MemorySettingsBackend();
+
+    GVariant *read(const QByteArray &path);
+    gchar **list(const QByteArray &dir);
+    bool write(const QByteArray &path, GVariant *value, QByteArray *tag, GError **error);
+    bool change(DConfChangeset *changeset, QByteArray *tag, GError **error);
+    void sync() {}
+    bool isWritable(const QByteArray &) { return true; }
+
+private:
+    typedef QHash<QByteArray, GVariantPtr> Shard;
+
+    struct Retired
+    {
+        Shard *shard;
+        int epoch;
+    };
+
+    enum
+    {
+        ShardCount = 256,
+        // replaced shards kept for reads in progress before a change waits
+        MaxRetired = 4 * ShardCount
+    };
+
+    static int shardOf(const QByteArray &path) { return qHash(path) % ShardCount; }
+    void apply(const QByteArray &path, GVariant *value);
+    void remove(const QByteArray &path);
+    void publish();
+    void reclaim();
+    void index(const QByteArray &path);
+    void unindex(const QByteArray &path);
+    void collectKeys(const QByteArray &dir, QList<QByteArray> *keys) const;
+
+    QMutex m_mutex;
+    // guarded by m_mutex
+    Shard m_values[ShardCount];
+    QSet<int> m_dirty;
+    QList<Retired> m_retired;
+    // the children ("key" or "dir/") of every directory with a value below it
+    QHash<QByteArray, QSet<QByteArray> > m_children;
+
+    // what read() sees: copies of m_values as of the last change
+    QAtomicPointer<Shard> m_published[ShardCount];
+};
+
+// Where the last segment of path starts: "/a/b/c" and "/a/b/" are the
+// children "c" and "b/" of "/a/b/" and "/a/".
+static int childStart(const QByteArray &path)
+{
+    return path.lastIndexOf('/', path.size() - 2) + 1;
+}
+
+MemorySettingsBackend::MemorySettingsBackend()
+{
+    for (int i = 0; i < ShardCount; ++i)
+        m_published[i] = new Shard;
+}
+
+MemorySettingsBackend::~MemorySettingsBackend()
+{
+    Q_FOREACH (const Retired &retired, m_retired)
+        delete retired.shard;
+    for (int i = 0; i < ShardCount; ++i)
+        delete m_published[i].fetchAndStoreRelaxed(0);
+}
+
+GVariant *MemorySettingsBackend::read(const QByteArray &path)
+{
+    int shard = shardOf(path);
+    SettingsReaders::Slot *slot = SettingsReaders::enter();
+
+    const Shard *values = m_published[shard].fetchAndAddAcquire(0);
+    Shard::const_iterator it = values->constFind(path);
+    GVariant *value = it != values->constEnd() ? g_variant_ref(it.value().get()) : NULL;
+
+    SettingsReaders::leave(slot);
+    return value;
+}
+
+gchar **MemorySettingsBackend::list(const QByteArray &dir)
+{
+    QMutexLocker locker(&m_mutex);
+    QSet<QByteArray> children = m_children.value(dir);
+
+    gchar **result = g_new(gchar *, children.size() + 1);
+    int i = 0;
+    Q_FOREACH (const QByteArray &child, children)
+        result[i++] = g_strdup(child.constData());
+    result[i] = NULL;
+    return result;
+}
+
+// Adds a new key to the directory index. Called with m_mutex held.
+void MemorySettingsBackend::index(const QByteArray &path)
+{
+    QByteArray child = path;
+    while (child != "/")
+    {
+        int start = childStart(child);
+        QSet<QByteArray> &children = m_children[child.left(start)];
+        bool known = !children.isEmpty();
+        children.insert(child.mid(start));
+        if (known)
+            return;
+        child.truncate(start);
+    }
+}
+
+// Drops a removed key, and the directories it leaves empty, from the index.
+// Called with m_mutex held.
+void MemorySettingsBackend::unindex(const QByteArray &path)
+{
+    QByteArray child = path;
+    while (child != "/")
+    {
+        int start = childStart(child);
+        QHash<QByteArray, QSet<QByteArray> >::iterator it = m_children.find(child.left(start));
+        if (it == m_children.end())
+            return;
+
+        it.value().remove(child.mid(start));
+        if (!it.value().isEmpty())
+            return;
+        m_children.erase(it);
+        child.truncate(start);
+    }
+}
+
+void MemorySettingsBackend::collectKeys(const QByteArray &dir, QList<QByteArray> *keys) const
+{
+    QHash<QByteArray, QSet<QByteArray> >::const_iterator it = m_children.constFind(dir);
+    if (it == m_children.constEnd())
+        return;
+
+    Q_FOREACH (const QByteArray &child, it.value())
+    {
+        if (child.endsWith('/'))
+            collectKeys(dir + child, keys);
+        else
+            *keys += dir + child;
+    }
+}
+
+// Called with m_mutex held.
+void MemorySettingsBackend::apply(const QByteArray &path, GVariant *value)
+{
+    if (value)
+    {
+        int shard = shardOf(path);
+        GVariantPtr &stored = m_values[shard][path];
+        if (stored.isNull())
+            index(path);
+        stored = GVariantPtr::ref(value);
+        m_dirty.insert(shard);
+    }
+    else if (path.endsWith('/'))
+    {
+        QList<QByteArray> keys;
+        collectKeys(path, &keys);
+        Q_FOREACH (const QByteArray &key, keys)
+            remove(key);
+    }
+    else
+    {
+        remove(path);
+    }
+}
+
+// Called with m_mutex held.
+void MemorySettingsBackend::remove(const QByteArray &path)
+{
+    int shard = shardOf(path);
+    if (m_values[shard].remove(path))
+    {
+        unindex(path);
+        m_dirty.insert(shard);
+    }
+}
+
+// Makes what apply() did visible to read(). Called with m_mutex held.
+void MemorySettingsBackend::publish()
+{
+    if (m_dirty.isEmpty())
+        return;
+
+    int first = m_retired.size();
+    Q_FOREACH (int shard, m_dirty)
+    {
+        // shares the data with m_values[shard] until that changes again
+        Retired retired;
+        retired.shard = m_published[shard].fetchAndStoreOrdered(new Shard(m_values[shard]));
+        m_retired.append(retired);
+    }
+    m_dirty.clear();
+
+    // reads from now on see the new shards
+    int epoch = SettingsReaders::advance();
+    for (int i = first; i < m_retired.size(); ++i)
+        m_retired[i].epoch = epoch;
+
+    reclaim();
+    while (m_retired.size() > MaxRetired)
+    {
+        QThread::yieldCurrentThread();
+        reclaim();
+    }
+}
+
+// Called with m_mutex held.
+void MemorySettingsBackend::reclaim()
+{
+    if (m_retired.isEmpty())
+        return;
+
+    int oldest = SettingsReaders::oldest(SettingsReaders::current());
+    while (!m_retired.isEmpty() && !SettingsReaders::before(oldest, m_retired.first().epoch))
+        delete m_retired.takeFirst().shard;
+}
+
+bool MemorySettingsBackend::write(const QByteArray &path, GVariant *value, QByteArray *tag, GError **error)
+{
+    Q_UNUSED(error);
+    {
+        QMutexLocker locker(&m_mutex);
+        apply(path, value);
+        publish();
+    }
+    QByteArray written = notify(path, QList<QByteArray>() << QByteArray(""));
+    if (tag)
+        *tag = written;
+    return true;
+}
+
+bool MemorySettingsBackend::change(DConfChangeset *changeset, QByteArray *tag, GError **error)
+{
+    Q_UNUSED(error);
+    const gchar *prefix;
+    const gchar * const *paths;
+    GVariant * const *values;
+    guint n = dconf_changeset_describe(changeset, &prefix, &paths, &values);
+
+    QList<QByteArray> changes;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (guint i = 0; i < n; ++i)
+        {
+            apply(QByteArray(prefix) + paths[i], values[i]);
+            changes += QByteArray(paths[i]);
+        }
+        // readers see the whole changeset or none of it
+        publish();
+    }
+
+    if (n && tag)
+        *tag = notify(prefix, changes);
+    else if (n)
+        notify(prefix, changes);
+    return true;
+}
+
+// A QSettings INI file, for systems without dconf. Values are stored in
+// GVariant text format, so they keep their types.
+class IniSettingsBackend : public LocalSettingsBackend
+{
+public:
+    IniSettingsBackend();
+
+    GVariant *read(const QByteArray &path);
+    gchar **list(const QByteArray &dir);
+    bool write(const QByteArray &path, GVariant *value, QByteArray *tag, GError **error);
+    bool change(DConfChangeset *changeset, QByteArray *tag, GError **error);
+    void sync();
+    bool isWritable(const QByteArray &path);
+
+private:
+    static QString key(const QByteArray &path) { return QString::fromLatin1(path.constData() + 1); }
+    void apply(const QByteArray &path, GVariant *value);
+
+    QMutex m_mutex;
+    QSettings m_settings;
+};
+
+IniSettingsBackend::IniSettingsBackend()
+    : m_settings(QSettings::IniFormat, QSettings::UserScope,
+                 QLatin1String("liblxqt-settings"), QLatin1String("dconf"))
+{
+}
+
+GVariant *IniSettingsBackend::read(const QByteArray &path)
+{
+    QMutexLocker locker(&m_mutex);
+    QVariant text = m_settings.value(key(path));
+    if (!text.isValid())
+        return NULL;
+
+    return g_variant_parse(NULL, text.toString().toUtf8().constData(), NULL, NULL, NULL);
+}
+
+gchar **IniSettingsBackend::list(const QByteArray &dir)
+{
+    QMutexLocker locker(&m_mutex);
+    m_settings.beginGroup(key(dir));
+    QStringList keys = m_settings.childKeys();
+    QStringList groups = m_settings.childGroups();
+    m_settings.endGroup();
+
+    gchar **result = g_new(gchar *, keys.size() + groups.size() + 1);
+    int i = 0;
+    Q_FOREACH (const QString &name, keys)
+        result[i++] = g_strdup(name.toLatin1().constData());
+    Q_FOREACH (const QString &name, groups)
+        result[i++] = g_strdup((name.toLatin1() + '/').constData());
+    result[i] = NULL;
+    return result;
+}
+
+void IniSettingsBackend::apply(const QByteArray &path, GVariant *value)
+{
+    if (!value)
+    {
+        m_settings.remove(key(path));
+        return;
+    }
+
+    gchar *text = g_variant_print(value, TRUE);
+    m_settings.setValue(key(path), QString::fromUtf8(text));
+    g_free(text);
+}
+
+bool IniSettingsBackend::write(const QByteArray &path, GVariant *value, QByteArray *tag, GError **error)
+{
+    Q_UNUSED(error);
+    {
+        QMutexLocker locker(&m_mutex);
+        apply(path, value);
+    }
+    QByteArray written = notify(path, QList<QByteArray>() << QByteArray(""));
+    if (tag)
+        *tag = written;
+    return true;
+}
+
+bool IniSettingsBackend::change(DConfChangeset *changeset, QByteArray *tag, GError **error)
+{
+    Q_UNUSED(error);
+    const gchar *prefix;
+    const gchar * const *paths;
+    GVariant * const *values;
+    guint n = dconf_changeset_describe(changeset, &prefix, &paths, &values);
+
+    QList<QByteArray> changes;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (guint i = 0; i < n; ++i)
+        {
+            apply(QByteArray(prefix) + paths[i], values[i]);
+            changes += QByteArray(paths[i]);
+        }
+    }
+
+    if (n && tag)
+        *tag = notify(prefix, changes);
+    else if (n)
+        notify(prefix, changes);
+    return true;
+}
+
+void IniSettingsBackend::sync()
+{
+    QMutexLocker locker(&m_mutex);
+    m_settings.sync();
+}
+
+bool IniSettingsBackend::isWritable(const QByteArray &path)
+{
+    Q_UNUSED(path);
+    QMutexLocker locker(&m_mutex);
+    return m_settings.isWritable();
+}
+
+Q_GLOBAL_STATIC(DConfSettingsBackend, dconfBackend)
+Q_GLOBAL_STATIC(MemorySettingsBackend, memoryBackend)
+Q_GLOBAL_STATIC(IniSettingsBackend, iniBackend)
+
+// DefaultBackend means LXQT_SETTINGS_BACKEND, or dconf.
+Settings::Backend SettingsBackend::resolve(Settings::Backend backend)
+{
+    if (backend != Settings::DefaultBackend)
+        return backend;
+
+    QByteArray name = qgetenv("LXQT_SETTINGS_BACKEND");
+    if (name == "memory")
+        return Settings::MemoryBackend;
+    if (name == "ini")
+        return Settings::IniBackend;
+    if (!name.isEmpty() && name != "dconf")
+        qWarning() << "LXQT_SETTINGS_BACKEND: unknown backend" << name << ", using dconf";
+    return Settings::DConfBackend;
+}
+
+// Returns 0 once the backend has been destroyed at exit.
+SettingsBackend *SettingsBackend::instance(Settings::Backend backend)
+{
+    switch (resolve(backend))
+    {
+    case Settings::MemoryBackend:
+        return memoryBackend();
+    case Settings::IniBackend:
+        return iniBackend();
+    default:
+        return dconfBackend();
+    }
+}
+
+// Directory tree of the application subtree, used by the key enumerations.
+// Directories are listed from dconf once, when first enumerated, and kept
+// up to date from our own writes and dconf change notifications.
+class SettingsIndex
+{
+public:
+    SettingsIndex(SettingsBackend *backend, const QByteArray &rootDir);
+
+    QStringList childKeys(const QByteArray &dir);
+    QStringList childGroups(const QByteArray &dir);
+    void allKeys(const QByteArray &dir, const QString &prefix, QStringList *result);
+
+    void keyChanged(const QByteArray &path, bool exists);
+    void invalidate(const QByteArray &dir);
+
+private:
+    struct Node
+    {
+        Node(Node *parent, const QByteArray &path);
+        ~Node();
+
+        Node *parent;
+        QByteArray path;
+        bool loaded;
+        bool present;   // has keys in dconf, as far as we know
+        QSet<QString> keys;
+        QMap<QString, Node *> dirs;
+    };
+
+    Node *node(const QByteArray &dir, bool create);
+    void load(Node *node);
+    void collectKeys(Node *node, const QString &prefix, QStringList *result);
+
+    SettingsBackend *m_backend;
+    Node m_root;
+};
+
+SettingsIndex::Node::Node(Node *parent, const QByteArray &path)
+    : parent(parent)
+    , path(path)
+    , loaded(false)
+    , present(false)
+{
+}
+
+SettingsIndex::Node::~Node()
+{
+    qDeleteAll(dirs);
+}
+
+SettingsIndex::SettingsIndex(SettingsBackend *backend, const QByteArray &rootDir)
+    : m_backend(backend)
+    , m_root(0, rootDir)
+{
+}
+
+// Finds the node of dir, which must be below the root and end with '/'.
+SettingsIndex::Node *SettingsIndex::node(const QByteArray &dir, bool create)
+{
+    if (!dir.startsWith(m_root.path))
+        return 0;
+
+    Node *node = &m_root;
+    int from = m_root.path.size();
+    int to;
+    while ((to = dir.indexOf('/', from)) != -1)
+    {
+        QString name = QString::fromLatin1(dir.constData() + from, to - from);
+        QMap<QString, Node *>::iterator it = node->dirs.find(name);
+        if (it == node->dirs.end())
+        {
+            if (!create)
+                return 0;
+            it = node->dirs.insert(name, new Node(node, dir.left(to + 1)));
+        }
+        node = it.value();
+        from = to + 1;
+    }
+    return node;
+}
+
+void SettingsIndex::load(Node *node)
+{
+    if (node->loaded)
+        return;
+
+    node->keys.clear();
+    QSet<QString> listed;
+
+    GStrvPtr keys(m_backend->list(node->path));
+    for (gchar **key = keys.begin(); key != keys.end(); ++key)
+    {
+        if (dconf_is_rel_dir(*key, NULL))
+        {
+            QString name = QString::fromLatin1(*key, qstrlen(*key) - 1);
+            Node *&child = node->dirs[name];
+            if (!child)
+                child = new Node(node, node->path + *key);
+            child->present = true;
+            listed.insert(name);
+        }
+        else if (dconf_is_rel_key(*key, NULL))
+        {
+            node->keys.insert(QString::fromLatin1(*key));
+        }
+    }
+
+    QMap<QString, Node *>::iterator it = node->dirs.begin();
+    while (it != node->dirs.end())
+    {
+        if (listed.contains(it.key()))
+        {
+            ++it;
+        }
+        else
+        {
+            delete it.value();
+            it = node->dirs.erase(it);
+        }
+    }
+
+    node->loaded = true;
+}
+
+QStringList SettingsIndex::childKeys(const QByteArray &dir)
+{
+    Node *n = node(dir, true);
+    if (!n)
+        return QStringList();
+
+    load(n);
+    return n->keys.toList();
+}
+
+QStringList SettingsIndex::childGroups(const QByteArray &dir)
+{
+    QStringList result;
+
+    Node *n = node(dir, true);
+    if (!n)
+        return result;
+
+    load(n);
+    for (QMap<QString, Node *>::const_iterator it = n->dirs.constBegin(); it != n->dirs.constEnd(); ++it)
+    {
+        if (it.value()->present)
+            result += it.key();
+    }
+    return result;
+}
+
+void SettingsIndex::allKeys(const QByteArray &dir, const QString &prefix, QStringList *result)
+{
+    Node *n = node(dir, true);
+    if (n)
+        collectKeys(n, prefix, result);
+}
+
+void SettingsIndex::collectKeys(Node *node, const QString &prefix, QStringList *result)
+{
+    load(node);
+
+    Q_FOREACH (const QString &key, node->keys)
+        result->append(prefix + key);
+
+    for (QMap<QString, Node *>::const_iterator it = node->dirs.constBegin(); it != node->dirs.constEnd(); ++it)
+    {
+        if (it.value()->present)
+            collectKeys(it.value(), prefix + it.key() + QLatin1Char('/'), result);
+    }
+}
+
+void SettingsIndex::keyChanged(const QByteArray &path, bool exists)
+{
+    int slash = path.lastIndexOf('/');
+    QString name = QString::fromLatin1(path.constData() + slash + 1);
+
+    if (exists)
+    {
+        Node *n = node(path.left(slash + 1), true);
+        if (!n)
+            return;
+
+        n->keys.insert(name);
+        for (; n && !n->present; n = n->parent)
+            n->present = true;
+        return;
+    }
+
+    Node *n = node(path.left(slash + 1), false);
+    if (!n)
+        return;
+
+    n->keys.remove(name);
+
+    // a directory disappears with its last key
+    while (n->parent && n->loaded && n->keys.isEmpty())
+    {
+        bool empty = true;
+        for (QMap<QString, Node *>::const_iterator it = n->dirs.constBegin(); it != n->dirs.constEnd(); ++it)
+            empty = empty && !it.value()->present;
+        if (!empty)
+            break;
+        n->present = false;
+        n = n->parent;
+    }
+}
+
+void SettingsIndex::invalidate(const QByteArray &dir)
+{
+    Node *n = node(dir, false);
+    if (!n)
+    {
+        // the directory may be new: relist the deepest node we know about
+        QByteArray parent = dir;
+        while (!n && parent.size() > m_root.path.size())
+        {
+            parent.truncate(parent.lastIndexOf('/', parent.size() - 2) + 1);
+            n = node(parent, false);
+        }
+        if (n)
+            n->loaded = false;
+        return;
+    }
+
+    qDeleteAll(n->dirs);
+    n->dirs.clear();
+    n->keys.clear();
+    n->loaded = false;
+    n->present = false;
+    if (n->parent)
+        n->parent->loaded = false;
+}
+
+// Receivers of Settings::watch() in a trie of path segments relative to the
+// application path. Delivering a change walks the changed path once, so it
+// costs the depth of the key, not the number of watchers.
+class SettingsWatchers
+{
+public:
+    void add(const QByteArray &path, QObject *receiver, int method);
+    void remove(const QByteArray &path, QObject *receiver, int method);
+    void dispatch(const QString &key);
+    QList<QByteArray> paths() const;
+
+private:
+    struct Watcher
+    {
+        QPointer<QObject> receiver;
+        int method;
+    };
+
+    struct Node
+    {
+        ~Node();
+
+        QList<Watcher> keyWatchers;     // the key named like this node
+        QList<Watcher> dirWatchers;     // everything below this node
+        QHash<QByteArray, Node *> children;
+    };
+
+    static QList<QByteArray> segments(const QByteArray &path, bool *dir);
+    static bool remove(Node *node, const QList<QByteArray> &segments, int i, bool dir, QObject *receiver, int method);
+    static void collect(QList<Watcher> &watchers, QList<Watcher> *result);
+    static void collectAll(Node *node, QList<Watcher> *result);
+    static bool live(const QList<Watcher> &watchers);
+    static void paths(const Node *node, const QByteArray &path, QList<QByteArray> *result);
+
+    Node m_root;
+};
+
+SettingsWatchers::Node::~Node()
+{
+    qDeleteAll(children);
+}
+
+// Splits path into its segments; "" and "/" stand for the application path.
+QList<QByteArray> SettingsWatchers::segments(const QByteArray &path, bool *dir)
+{
+    *dir = path.isEmpty() || path.endsWith('/');
+    if (path.isEmpty() || path == "/")
+        return QList<QByteArray>();
+
+    QList<QByteArray> result = path.split('/');
+    if (*dir)
+        result.removeLast();
+    return result;
+}
+
+void SettingsWatchers::add(const QByteArray &path, QObject *receiver, int method)
+{
+    bool dir;
+    Node *node = &m_root;
+    Q_FOREACH (const QByteArray &segment, segments(path, &dir))
+    {
+        Node *&child = node->children[segment];
+        if (!child)
+            child = new Node;
+        node = child;
+    }
+
+    Watcher watcher;
+    watcher.receiver = receiver;
+    watcher.method = method;
+    if (dir)
+        node->dirWatchers += watcher;
+    else
+        node->keyWatchers += watcher;
+}
+
+void SettingsWatchers::remove(const QByteArray &path, QObject *receiver, int method)
+{
+    bool dir;
+    remove(&m_root, segments(path, &dir), 0, dir, receiver, method);
+}
+
+// Removes the watches of receiver (for method, or all when it is -1) and
+// returns whether node is left empty.
+bool SettingsWatchers::remove(Node *node, const QList<QByteArray> &segments, int i, bool dir,
+                              QObject *receiver, int method)
+{
+    if (i < segments.size())
+    {
+        QHash<QByteArray, Node *>::iterator it = node->children.find(segments[i]);
+        if (it != node->children.end() && remove(it.value(), segments, i + 1, dir, receiver, method))
+        {
+            delete it.value();
+            node->children.erase(it);
+        }
+    }
+    else
+    {
+        QList<Watcher> &watchers = dir ? node->dirWatchers : node->keyWatchers;
+        QList<Watcher>::iterator it = watchers.begin();
+        while (it != watchers.end())
+        {
+            if (!it->receiver || (it->receiver == receiver && (method == -1 || it->method == method)))
+                it = watchers.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    return node->keyWatchers.isEmpty() && node->dirWatchers.isEmpty() && node->children.isEmpty();
+}
+
+void SettingsWatchers::dispatch(const QString &key)
+{
+    bool dir;
+    QList<QByteArray> path = segments(key.toLatin1(), &dir);
+
+    // collect first: the slots may add or remove watches
+    QList<Watcher> matched;
+    Node *node = &m_root;
+    Q_FOREACH (const QByteArray &segment, path)
+    {
+        collect(node->dirWatchers, &matched);
+        node = node->children.value(segment);
+        if (!node)
+            break;
+    }
+
+    if (node && dir)
+        collectAll(node, &matched);
+    else if (node)
+        collect(node->keyWatchers, &matched);
+
+    Q_FOREACH (const Watcher &watcher, matched)
+    {
+        QObject *receiver = watcher.receiver;
+        if (!receiver)
+            continue;
+
+        QMetaMethod method = receiver->metaObject()->method(watcher.method);
+        if (method.parameterTypes().isEmpty())
+            method.invoke(receiver, Qt::AutoConnection);
+        else
+            method.invoke(receiver, Qt::AutoConnection, Q_ARG(QString, key));
+    }
+}
+
+bool SettingsWatchers::live(const QList<Watcher> &watchers)
+{
+    Q_FOREACH (const Watcher &watcher, watchers)
+    {
+        if (watcher.receiver)
+            return true;
+    }
+    return false;
+}
+
+// The outermost watched paths, in watchPath() form.
+QList<QByteArray> SettingsWatchers::paths() const
+{
+    QList<QByteArray> result;
+    paths(&m_root, QByteArray(), &result);
+    return result;
+}
+
+void SettingsWatchers::paths(const Node *node, const QByteArray &path, QList<QByteArray> *result)
+{
+    if (live(node->dirWatchers))
+    {
+        *result += path.isEmpty() ? path : path + '/';
+        return;
+    }
+    if (live(node->keyWatchers))
+        *result += path;
+
+    QHash<QByteArray, Node *>::const_iterator it;
+    for (it = node->children.constBegin(); it != node->children.constEnd(); ++it)
+        paths(it.value(), path.isEmpty() ? it.key() : path + '/' + it.key(), result);
+}
+
+// Appends the live watchers to result, dropping those of deleted receivers.
+void SettingsWatchers::collect(QList<Watcher> &watchers, QList<Watcher> *result)
+{
+    QList<Watcher>::iterator it = watchers.begin();
+    while (it != watchers.end())
+    {
+        if (it->receiver)
+        {
+            result->append(*it);
+            ++it;
+        }
+        else
+        {
+            it = watchers.erase(it);
+        }
+    }
+}
+
+// A reset directory: everybody watching a key or a prefix below node.
+void SettingsWatchers::collectAll(Node *node, QList<Watcher> *result)
+{
+    collect(node->dirWatchers, result);
+    Q_FOREACH (Node *child, node->children)
+    {
+        collect(child->keyWatchers, result);
+        collectAll(child, result);
+    }
+}
+
+Settings::Statistics::Statistics()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+// Counts an operation and, with latency tracking on, times it.
+class OperationTimer
+{
+public:
+    OperationTimer(Settings::Statistics *stats, bool timed, Settings::Statistics::Operation operation)
+        : m_stats(stats)
+        , m_operation(operation)
+        , m_timed(timed)
+    {
+        ++stats->calls[operation];
+        if (timed)
+            m_timer.start();
+    }
+
+    ~OperationTimer()
+    {
+        if (!m_timed)
+            return;
+
+        qint64 slices = m_timer.nsecsElapsed() >> 8;
+        int bucket = 0;
+        for (; slices && bucket < Settings::Statistics::LatencyBuckets - 1; slices >>= 1)
+            ++bucket;
+        ++m_stats->latency[m_operation][bucket];
+    }
+
+private:
+    Settings::Statistics *m_stats;
+    Settings::Statistics::Operation m_operation;
+    bool m_timed;
+    QElapsedTimer m_timer;
+};
+
+class SettingsPrivate : public SettingsBackendListener
+{
+    Settings *q_ptr;
+    Q_DECLARE_PUBLIC(Settings)
+
+public:
+    SettingsPrivate(Settings *q, const QString &organization, const QString &application,
+                    Settings::Backend backend);
+    ~SettingsPrivate();
+
+    void clear();
+    void sync();
+    QSettings::Status status() const;
+
+    void beginGroup(const QString &prefix);
+    void endGroup();
+    QString group() const;
+
+    int beginReadArray(const QString& prefix);
+    void beginWriteArray(const QString& prefix, int size);
+    void endArray();
+    void setArrayIndex(int i);
+    QVector<QVariantHash> readArray(const QString &prefix);
+    QVariantHash readGroup(const QString &prefix, bool recursive) const;
+    QVariantHash values(const QStringList &keys) const;
+
+    QStringList allKeys() const;
+    QStringList childKeys() const;
+    QStringList childGroups() const;
+    bool isWritable() const;
+
+    void setValue(const QString &key, const QVariant &value);
+    QVariant value(const QString &key, const QVariant &defaultValue = QVariant()) const;
+
+    void remove(const QString &key);
+    bool contains(const QString &key) const;
+
+    int removeAsync(const QStringList &keys);
+    int clearAsync();
+    void removalFinished(int id, bool ok, const QByteArray &error, const QByteArray &tag);
+
+    Settings::Key key(const QString &key) const;
+    void setValue(const Settings::Key &key, const QVariant &value);
+    QVariant value(const Settings::Key &key, const QVariant &defaultValue) const;
+    bool contains(const Settings::Key &key) const;
+
+    template <typename T> bool get(const char *key, T *result) const;
+    template <typename T> void set(const char *key, const T &value);
+
+    QString organizationName() const;
+    QString applicationName() const;
+
+    quint64 cacheHitCount() const;
+    quint64 cacheMissCount() const;
+
+    void setReadConsistency(Settings::ReadConsistency consistency);
+    Settings::ReadConsistency readConsistency() const;
+
+    void beginTransaction();
+    bool commit();
+    void rollback();
+    bool inTransaction() const;
+
+    void setStorageFormat(Settings::StorageFormat format);
+    Settings::StorageFormat storageFormat() const;
+
+    void setChangeInterval(int msecs);
+    int changeInterval() const;
+    bool timerEvent(int timerId);
+
+    void setWriteDelay(int msecs);
+    int writeDelay() const;
+
+    void setIgnoreOwnChanges(bool ignore);
+    bool ignoreOwnChanges() const;
+
+    bool watch(const QString &keyOrPrefix, QObject *receiver, const char *slot);
+    void unwatch(const QString &keyOrPrefix, QObject *receiver, const char *slot);
+    void updateWatches();
+
+    Settings::Statistics statistics() const;
+    void resetStatistics();
+    void setLatencyTracking(bool enabled);
+    bool latencyTracking() const;
+
+    Settings::Backend backend() const;
+
+    void prefetch(const QStringList &groups);
+    bool waitForPrefetch(int msecs);
+
+private:
+    Settings::Backend m_backendType;
+    SettingsBackend *m_backend;
+    // stands in for the process-wide backend when that was destroyed at exit
+    SettingsBackend *m_ownedBackend;
+    mutable SettingsCache m_cache;
+    SettingsIndex *m_index;
+    Settings::ReadConsistency m_consistency;
+    // values written without waiting for the backend since the last sync
+    mutable QHash<QByteArray, QVariant> m_pendingWrites;
+    mutable bool m_outstandingWrites;
+    // writes and resets staged by an open transaction
+    DConfChangeset *m_changeset;
+    int m_transactionDepth;
+    bool m_transactionAborted;  // a nested rollback() dooms the outermost commit()
+    // write-behind: the latest value of each key set within m_writeDelay,
+    // flushed as one changeset
+    int m_writeDelay;
+    QBasicTimer m_writeTimer;
+    DConfChangeset *m_writeBuffer;
+    Settings::StorageFormat m_storageFormat;
+    QString m_organizationName;
+    QString m_applicationName;
+    // Group stack. Paths are kept latin1 encoded and '/' terminated, so a
+    // group push appends to m_currentPath and a pop truncates it.
+    struct Group
+    {
+        bool array;
+        int start;       // length of m_currentPath before the group
+        int indexStart;  // arrays only: where the index segment starts
+        bool writing;    // beginWriteArray()
+        int size;        // written arrays: the size endArray() stores, -1
+                         // while no index was set and no size declared
+    };
+
+    QByteArray m_rootPath;
+    QByteArray m_currentPath;
+    QStack<Group> m_groups;
+
+    // change notifications not delivered yet
+    int m_changeInterval;
+    QBasicTimer m_changeTimer;
+    QStringList m_changedKeys;
+    QSet<QString> m_changedKeySet;
+    QString m_changedPrefix;
+    bool m_prefixChanged;
+    SettingsWatchers m_watchers;
+
+    // changes we made whose notifications have not arrived yet
+    struct OwnWrite
+    {
+        OwnWrite() : echoes(0) {}
+        GVariantPtr value;  // NULL for a reset
+        int echoes;
+    };
+
+    // backend paths watched for us. Only they are served from the cache:
+    // without notifications it cannot know when to forget a value.
+    QSet<QByteArray> m_watched;
+    QAtomicInt m_rootWatched;   // read by lookupShared()
+    bool m_watchPinned;         // prefetch() wants the cache whatever listens
+    // reads want the cache until they stop for ReadWatchIdle, see watchForRead()
+    mutable bool m_readWatch;
+    mutable bool m_readSinceTick;
+    QBasicTimer m_readWatchTimer;
+    bool m_ignoreOwnChanges;
+    QList<QByteArray> m_ownTags;
+    QHash<QByteArray, OwnWrite> m_ownWrites;
+
+    // asynchronous removals not finished yet, oldest first; they run one
+    // at a time, in order, on m_removalPool
+    struct Removal
+    {
+        int id;
+        QList<QByteArray> paths;
+    };
+    QList<Removal> m_removals;
+    int m_lastRemovalId;
+    // removals of the open transaction, reported by its end
+    QList<int> m_stagedRemovals;
+    // tags of finished removals whose notification has not arrived yet
+    QList<QByteArray> m_removalTags;
+    // Tagged notifications that arrived while removals ran, before their
+    // tags were known. Those of our removals are dropped when they finish,
+    // the others handled once none is left.
+    struct HeldNotification
+    {
+        QByteArray prefix;
+        QList<QByteArray> changes;
+        QByteArray tag;
+    };
+    QList<HeldNotification> m_heldNotifications;
+    QThreadPool m_removalPool;
+    QObject *m_removalReceiver;
+
+    // background prefetch; the guarded members are written by its thread
+    QFuture<void> m_prefetch;
+    QMutex m_prefetchMutex;
+    QWaitCondition m_prefetchDone;
+    bool m_prefetching;         // guarded by m_prefetchMutex
+    QList<QByteArray> m_prefetchQueue;  // guarded by m_prefetchMutex
+    quint64 m_prefetchedKeys;   // guarded by m_prefetchMutex
+    quint64 m_prefetchNsecs;    // guarded by m_prefetchMutex
+    mutable QSet<QByteArray> m_prefetchUsed;
+
+    mutable Settings::Statistics m_stats;
+    bool m_latencyTracking;
+    quint64 m_cacheHitsBase;
+    quint64 m_cacheMissesBase;
+
+    void backendChanged(const char *prefix, const char * const *changes, const char *tag);
+    bool isWatched(const QByteArray &path) const;
+    void watchForRead(const QByteArray &path) const;
+    void readWatchTick();
+    void queueChange(const QByteArray &path);
+    void queuePrefix(const QString &prefix);
+    void deliverChanges();
+    QByteArray watchPath(const QString &keyOrPrefix) const;
+    static int watchMethod(QObject *receiver, const char *slot);
+
+    static QByteArray normalisedPath(const QString &path);
+    void pushGroup(const QString &prefix, bool array);
+    int arraySize();
+    bool read(const QByteArray &path, QVariant *result, gsize *size = 0) const;
+    bool lookup(const QByteArray &path, QVariant *result) const;
+    bool lookupLocal(const QByteArray &path, bool *exists, QVariant *result) const;
+    bool lookupShared(const QByteArray &path, QVariant *result) const;
+    void lookupMany(const QVector<SettingsRead> &reads, QVariantHash *result) const;
+    void runPrefetch(const QList<QByteArray> &dirs);
+    bool onOwnerThread() const;
+    bool lookupStaged(const QByteArray &path, bool *exists, QVariant *result) const;
+    void syncForRead() const;
+    QStringList pendingKeys(const QByteArray &dir) const;
+    void dropPendingWrites(const QByteArray &path) const;
+    void write(const QByteArray &path, const QVariant &value);
+    void write(const QByteArray &path, GVariant *value);
+    void recordWrite(const QByteArray &path, GVariant *value, bool fast);
+    void expectEcho(const QByteArray &tag, const QByteArray &path, GVariant *value);
+    bool isEcho(const QByteArray &path, const GVariantPtr &current);
+    bool apply(DConfChangeset *changeset, const char *what);
+    void discardTransaction();
+    void finishStagedRemovals(bool ok);
+    bool backendAlive() const;
+    void flushWrites();
+    void updateIndex(const QByteArray &path);
+    int startRemoval(const QList<QByteArray> &paths);
+    QList<QByteArray> collapseResets(const QSet<QByteArray> &paths);
+    bool hasUnlistedKeys(const QByteArray &dir) const;
+    bool isRemoving(const QByteArray &path) const;
+    void dropRemoving(const QByteArray &dir, QStringList *names, int skip, bool groups) const;
+    void waitForRemovals();
+};
+
+// Receives the results of asynchronous removals in the thread of the
+// Settings object.
+class SettingsRemovalReceiver : public QObject
+{
+public:
+    class FinishedEvent : public QEvent
+    {
+    public:
+        FinishedEvent(int id, bool ok, const QByteArray &error, const QByteArray &tag = QByteArray())
+            : QEvent(finishedType())
+            , id(id)
+            , ok(ok)
+            , error(error)
+            , tag(tag)
+        {
+        }
+
+        int id;
+        bool ok;
+        QByteArray error;
+        QByteArray tag;     // the change is notified with
+    };
+
+    explicit SettingsRemovalReceiver(SettingsPrivate *d) : m_d(d) {}
+
+    static QEvent::Type finishedType()
+    {
+        static QEvent::Type type = QEvent::Type(QEvent::registerEventType());
+        return type;
+    }
+
+    bool event(QEvent *event)
+    {
+        if (event->type() != finishedType())
+            return QObject::event(event);
+
+        FinishedEvent *finished = static_cast<FinishedEvent *>(event);
+        m_d->removalFinished(finished->id, finished->ok, finished->error, finished->tag);
+        return true;
+    }
+
+private:
+    SettingsPrivate *m_d;
+};
+
+// Applies the resets of one asynchronous removal on a worker thread.
+class SettingsRemoval : public QRunnable
+{
+public:
+    SettingsRemoval(SettingsBackend *backend, DConfChangeset *changeset, int id, QObject *receiver)
+        : m_backend(backend)
+        , m_changeset(changeset)
+        , m_id(id)
+        , m_receiver(receiver)
+    {
+    }
+
+    ~SettingsRemoval()
+    {
+        dconf_changeset_unref(m_changeset);
+    }
+
+    void run()
+    {
+        GErrorPtr err;
+        QByteArray tag;
+        bool ok = m_backend->changeSync(m_changeset, &tag, err.out());
+        QByteArray error = err.isSet() ? QByteArray(err.message()) : QByteArray();
+        QCoreApplication::postEvent(m_receiver, new SettingsRemovalReceiver::FinishedEvent(m_id, ok, error, tag));
+    }
+
+private:
+    SettingsBackend *m_backend;
+    DConfChangeset *m_changeset;
+    int m_id;
+    QObject *m_receiver;
+};
+
+SettingsPrivate::SettingsPrivate(Settings *q, const QString &organization, const QString &application,
+                                 Settings::Backend backend)
+    : q_ptr(q)
+    , m_backendType(SettingsBackend::resolve(backend))
+    , m_backend(SettingsBackend::instance(m_backendType))
+    , m_ownedBackend(0)
+    , m_cache(q)
+    , m_index(0)
+    , m_consistency(Settings::StrictConsistency)
+    , m_outstandingWrites(false)
+    , m_changeset(0)
+    , m_transactionDepth(0)
+    , m_transactionAborted(false)
+    , m_writeDelay(0)
+    , m_writeBuffer(0)
+    , m_storageFormat(Settings::StringStorage)
+    , m_organizationName(organization)
+    , m_applicationName(application)
+    , m_changeInterval(0)
+    , m_prefixChanged(false)
+    , m_ignoreOwnChanges(true)
+    , m_rootWatched(0)
+    , m_watchPinned(false)
+    , m_readWatch(false)
+    , m_readSinceTick(false)
+    , m_lastRemovalId(0)
+    , m_removalReceiver(0)
+    , m_prefetching(false)
+    , m_prefetchedKeys(0)
+    , m_prefetchNsecs(0)
+    , m_latencyTracking(false)
+    , m_cacheHitsBase(0)
+    , m_cacheMissesBase(0)
+{
+    QString root = m_organizationName;
+    if (!m_applicationName.isEmpty())
+    {
+        root += QLatin1String("/") + m_applicationName;
+    }
+    m_rootPath = '/' + normalisedPath(root) + '/';
+    m_currentPath = m_rootPath;
+
+    // created at exit, after the backends were destroyed
+    if (!m_backend)
+    {
+        qWarning() << "Settings created after its backend was destroyed, values are kept in memory only";
+        m_ownedBackend = new MemorySettingsBackend;
+        m_backend = m_ownedBackend;
+    }
+
+    // watched once something listens, see updateWatches()
+    m_backend->addListener(this);
+
+    m_removalPool.setMaxThreadCount(1);
+    m_removalReceiver = new SettingsRemovalReceiver(this);
+
+    m_index = new SettingsIndex(m_backend, m_rootPath);
+
+    // "1" or "all" prefetches the application, anything else names groups
+    QByteArray groups = qgetenv("LXQT_SETTINGS_PREFETCH");
+    if (groups == "1" || groups == "all")
+        prefetch(QStringList());
+    else if (!groups.isEmpty())
+        prefetch(QString::fromLocal8Bit(groups).split(QLatin1Char(','), QString::SkipEmptyParts));
+}
+
+SettingsPrivate::~SettingsPrivate()
+{
+    if (m_changeset)
+    {
+        qWarning() << "Settings destroyed with an open transaction, discarding it";
+        discardTransaction();
+    }
+
+    m_prefetch.waitForFinished();
+    // the results are dropped: nobody is left to tell
+    m_removalPool.waitForDone();
+    delete m_removalReceiver;
+
+    if (backendAlive())
+    {
+        flushWrites();
+        Q_FOREACH (const QByteArray &path, m_watched)
+            m_backend->unwatch(path);
+        m_backend->removeListener(this);
+    }
+
+    if (m_writeBuffer)
+        dconf_changeset_unref(m_writeBuffer);
+    delete m_index;
+    delete m_ownedBackend;
+}
+
+// The process-wide backends are gone when we are destroyed at exit.
+bool SettingsPrivate::backendAlive() const
+{
+    return m_ownedBackend || SettingsBackend::instance(m_backendType);
+}
+
+void SettingsPrivate::backendChanged(const char *prefix, const char * const *changes, const char *tag)
+{
+    if (SETTINGS_TRACE_ENABLED(TraceNotify))
+    {
+        qDebug() << "backendChanged(), prefix: " << prefix;
+        for (const char * const *change = changes; change && *change; ++change)
+            qDebug() << "backendChanged(), change: " << *change;
+        qDebug() << "backendChanged(), tag: " << tag;
+    }
+
+    // the backend reports the changes of every watched application
+    QByteArray base(prefix);
+    if (!base.startsWith(m_rootPath) && !m_rootPath.startsWith(base))
+        return;
+
+    // it may be a removal of ours that did not tell its tag yet
+    if (tag && m_ignoreOwnChanges && !m_removals.isEmpty()
+            && !m_ownTags.contains(QByteArray(tag)) && !m_removalTags.contains(QByteArray(tag)))
+    {
+        HeldNotification held;
+        held.prefix = base;
+        for (const char * const *change = changes; change && *change; ++change)
+            held.changes += QByteArray(*change);
+        held.tag = tag;
+        m_heldNotifications += held;
+        return;
+    }
+
+    ++m_stats.notifications;
+
+    if (tag && m_removalTags.removeOne(QByteArray(tag)))
+    {
+        ++m_stats.ownChangesIgnored;
+        return;
+    }
+
+    // our own change: the cache already has it. Notifications arrive in
+    // the order of the changes, so those of older tags were lost.
+    int own = tag ? m_ownTags.indexOf(QByteArray(tag)) : -1;
+    if (own >= 0)
+    {
+        m_ownTags.erase(m_ownTags.begin(), m_ownTags.begin() + own + 1);
+        ++m_stats.ownChangesIgnored;
+        return;
+    }
+
+    bool foreign = false;
+    if (!changes || !*changes)
+    {
+        m_cache.invalidatePrefix(base);
+        m_index->invalidate(base);
+        queueChange(base);
+        foreign = true;
+    }
+    else
+    {
+        for (const char * const *change = changes; *change; ++change)
+        {
+            QByteArray path = base + *change;
+            if (path.endsWith('/'))
+            {
+                m_cache.invalidatePrefix(path);
+                m_index->invalidate(path);
+            }
+            else
+            {
+                GVariantPtr current(m_backend->read(path));
+                if (isEcho(path, current))
+                    continue;
+                m_cache.invalidate(path);
+                m_index->keyChanged(path, !current.isNull());
+            }
+            queueChange(path);
+            foreign = true;
+
+            // someone else wrote the key after us: our pending value is no
+            // longer current
+            dropPendingWrites(path);
+        }
+    }
+
+    if (!foreign)
+    {
+        ++m_stats.ownChangesIgnored;
+        return;
+    }
+
+    if (base.size() > m_rootPath.size())
+    {
+        QString qPrefix = QString::fromLatin1(base.constData() + m_rootPath.size());
+        SETTINGS_TRACE(TraceNotify) << "backendChanged(), qPrefix: " << qPrefix;
+        queuePrefix(qPrefix);
+    }
+
+    if (m_changeInterval <= 0)
+        deliverChanges();
+    else if (!m_changeTimer.isActive())
+        m_changeTimer.start(m_changeInterval, q_ptr);
+}
+
+// Adds the absolute path of a changed key or directory to the next
+// keysChanged(). A reset above the application path resets all of it.
+void SettingsPrivate::queueChange(const QByteArray &path)
+{
+    QString key;
+    if (path.startsWith(m_rootPath))
+        key = QString::fromLatin1(path.constData() + m_rootPath.size());
+    else if (!m_rootPath.startsWith(path))
+        return;
+
+    if (key.isEmpty())
+        key = QLatin1String("/");
+
+    if (!m_changedKeySet.contains(key))
+    {
+        m_changedKeySet.insert(key);
+        m_changedKeys += key;
+    }
+}
+
+// Narrows the prefix the next changed() reports down to the deepest
+// directory (or key) containing every prefix queued so far.
+void SettingsPrivate::queuePrefix(const QString &prefix)
+{
+    if (!m_prefixChanged)
+    {
+        m_changedPrefix = prefix;
+        m_prefixChanged = true;
+        return;
+    }
+
+    int n = qMin(m_changedPrefix.size(), prefix.size());
+    int i = 0;
+    while (i < n && m_changedPrefix.at(i) == prefix.at(i))
+        ++i;
+
+    if (i == m_changedPrefix.size() && (i == prefix.size() || m_changedPrefix.endsWith(QLatin1Char('/'))))
+        return;
+    int slash = i > 0 ? m_changedPrefix.lastIndexOf(QLatin1Char('/'), i - 1) : -1;
+    m_changedPrefix.truncate(slash + 1);
+}
+
+void SettingsPrivate::deliverChanges()
+{
+    m_changeTimer.stop();
+
+    QStringList keys = m_changedKeys;
+    QString prefix = m_changedPrefix;
+    bool prefixChanged = m_prefixChanged;
+    m_changedKeys.clear();
+    m_changedKeySet.clear();
+    m_changedPrefix.clear();
+    m_prefixChanged = false;
+
+    Q_Q(Settings);
+    if (!keys.isEmpty())
+        Q_EMIT q->keysChanged(keys);
+    if (prefixChanged)
+        Q_EMIT q->changed(prefix);
+
+    Q_FOREACH (const QString &key, keys)
+        m_watchers.dispatch(key);
+
+    // receivers may have gone since
+    updateWatches();
+}
+
+// Path of a watch relative to the application path, '/' terminated for
+// prefixes.
+QByteArray SettingsPrivate::watchPath(const QString &keyOrPrefix) const
+{
+    QByteArray path = m_currentPath.mid(m_rootPath.size()) + normalisedPath(keyOrPrefix);
+    if (!path.isEmpty() && !path.endsWith('/') && (keyOrPrefix.isEmpty() || keyOrPrefix.endsWith(QLatin1Char('/'))))
+        path += '/';
+    return path;
+}
+
+// Resolves a SLOT() (or SIGNAL()) to a method of receiver taking nothing
+// or a QString.
+int SettingsPrivate::watchMethod(QObject *receiver, const char *slot)
+{
+    if (!receiver || !slot)
+        return -1;
+
+    int code = *slot - '0';
+    if (code == QSLOT_CODE || code == QSIGNAL_CODE)
+        ++slot;
+
+    const QMetaObject *meta = receiver->metaObject();
+    int index = meta->indexOfMethod(QMetaObject::normalizedSignature(slot).constData());
+    if (index < 0)
+    {
+        qWarning() << "watch(): no such method" << slot << "on" << meta->className();
+        return -1;
+    }
+
+    QList<QByteArray> types = meta->method(index).parameterTypes();
+    if (!types.isEmpty() && types != (QList<QByteArray>() << "QString"))
+    {
+        qWarning() << "watch():" << slot << "must take no arguments or a QString";
+        return -1;
+    }
+    return index;
+}
+
+bool SettingsPrivate::watch(const QString &keyOrPrefix, QObject *receiver, const char *slot)
+{
+    int method = watchMethod(receiver, slot);
+    if (method < 0)
+        return false;
+
+    m_watchers.add(watchPath(keyOrPrefix), receiver, method);
+    updateWatches();
+    return true;
+}
+
+void SettingsPrivate::unwatch(const QString &keyOrPrefix, QObject *receiver, const char *slot)
+{
+    int method = slot ? watchMethod(receiver, slot) : -1;
+    if (slot && method < 0)
+        return;
+
+    m_watchers.remove(watchPath(keyOrPrefix), receiver, method);
+    updateWatches();
+}
+
+// How long, in milliseconds, the application path stays watched for the
+// cache after the last read.
+static const int ReadWatchIdle = 10000;
+
+// Watches what is listened to: the application path while changed() or
+// keysChanged() have receivers or reads use the cache, otherwise only the
+// watched keys and prefixes, and nothing at all when nobody listens.
+void SettingsPrivate::updateWatches()
+{
+    Q_Q(Settings);
+    QList<QByteArray> wanted;
+    if (m_watchPinned || m_readWatch
+            || q->receivers(SIGNAL(changed(QString))) > 0
+            || q->receivers(SIGNAL(keysChanged(QStringList))) > 0)
+    {
+        wanted += m_rootPath;
+    }
+    else
+    {
+        Q_FOREACH (const QByteArray &path, m_watchers.paths())
+            wanted += m_rootPath + path;
+    }
+
+    QSet<QByteArray> paths;
+    Q_FOREACH (const QByteArray &path, wanted)
+    {
+        bool covered = false;
+        Q_FOREACH (const QByteArray &other, wanted)
+            covered = covered || (other != path && other.endsWith('/') && path.startsWith(other));
+        if (!covered)
+            paths.insert(path);
+    }
+
+    Q_FOREACH (const QByteArray &path, m_watched - paths)
+    {
+        m_backend->unwatch(path);
+        // nothing would tell the cache about changes any more
+        if (path.endsWith('/'))
+        {
+            m_cache.invalidatePrefix(path);
+            m_index->invalidate(path);
+        }
+        else
+        {
+            m_cache.invalidate(path);
+        }
+    }
+    Q_FOREACH (const QByteArray &path, paths - m_watched)
+    {
+        m_backend->watch(path);
+        // whatever changed while unwatched went unnoticed
+        if (path.endsWith('/'))
+        {
+            m_cache.invalidatePrefix(path);
+            m_index->invalidate(path);
+        }
+        else
+        {
+            m_cache.invalidate(path);
+        }
+    }
+
+    m_watched = paths;
+    m_rootWatched = paths.contains(m_rootPath);
+
+    // expectations for paths no longer watched would never be met
+    if (m_watched.isEmpty())
+    {
+        m_ownTags.clear();
+        m_removalTags.clear();
+    }
+    QHash<QByteArray, OwnWrite>::iterator it = m_ownWrites.begin();
+    while (it != m_ownWrites.end())
+    {
+        if (isWatched(it.key()))
+            ++it;
+        else
+            it = m_ownWrites.erase(it);
+    }
+}
+
+bool SettingsPrivate::isWatched(const QByteArray &path) const
+{
+    if (m_rootWatched)
+        return true;
+
+    Q_FOREACH (const QByteArray &watched, m_watched)
+    {
+        if (path == watched || (watched.endsWith('/') && path.startsWith(watched)))
+            return true;
+    }
+    return false;
+}
+
+// Watches the application path before the cache or the index answers for
+// path, since only notifications tell them what changed. The watch stays
+// while reads go on and goes once they stopped for ReadWatchIdle.
+void SettingsPrivate::watchForRead(const QByteArray &path) const
+{
+    m_readSinceTick = true;
+    if (m_readWatch || isWatched(path))
+        return;
+
+    SettingsPrivate *self = const_cast<SettingsPrivate *>(this);
+    m_readWatch = true;
+    self->updateWatches();
+    self->m_readWatchTimer.start(ReadWatchIdle, q_ptr);
+}
+
+void SettingsPrivate::readWatchTick()
+{
+    if (m_readSinceTick)
+    {
+        m_readSinceTick = false;
+        return;
+    }
+
+    m_readWatchTimer.stop();
+    m_readWatch = false;
+    updateWatches();
+}
+
+void SettingsPrivate::setChangeInterval(int msecs)
+{
+    m_changeInterval = qMax(0, msecs);
+    if (m_changeInterval == 0 && m_changeTimer.isActive())
+        deliverChanges();
+}
+
+int SettingsPrivate::changeInterval() const
+{
+    return m_changeInterval;
+}
+
+bool SettingsPrivate::timerEvent(int timerId)
+{
+    if (timerId == m_writeTimer.timerId())
+        flushWrites();
+    else if (timerId == m_changeTimer.timerId())
+        deliverChanges();
+    else if (timerId == m_readWatchTimer.timerId())
+        readWatchTick();
+    else
+        return false;
+    return true;
+}
+
+void SettingsPrivate::setWriteDelay(int msecs)
+{
+    m_writeDelay = qMax(0, msecs);
+    if (m_writeDelay == 0)
+        flushWrites();
+}
+
+int SettingsPrivate::writeDelay() const
+{
+    return m_writeDelay;
+}
+
+void SettingsPrivate::setIgnoreOwnChanges(bool ignore)
+{
+    m_ignoreOwnChanges = ignore;
+    if (!ignore)
+    {
+        m_ownTags.clear();
+        m_ownWrites.clear();
+        m_removalTags.clear();
+    }
+}
+
+bool SettingsPrivate::ignoreOwnChanges() const
+{
+    return m_ignoreOwnChanges;
+}
+
+// Latin1 encodes path without leading, trailing and repeated slashes.
+QByteArray SettingsPrivate::normalisedPath(const QString &path)
+{
+    QByteArray result;
+    result.reserve(path.size());
+
+    const QChar *c = path.unicode();
+    const QChar *end = c + path.size();
+    for (; c != end; ++c)
+    {
+        ushort u = c->unicode();
+        if (u == '/' && (result.isEmpty() || result.endsWith('/')))
+            continue;
+        result += u > 0xff ? '?' : char(u);
+    }
+
+    if (result.endsWith('/'))
+        result.chop(1);
+    return result;
+}
+
+void SettingsPrivate::pushGroup(const QString &prefix, bool array)
+{
+    Group group;
+    group.array = array;
+    group.start = m_currentPath.size();
+    group.indexStart = -1;
+    group.writing = false;
+    group.size = -1;
+
+    QByteArray path = normalisedPath(prefix);
+    if (!path.isEmpty())
+        m_currentPath += path + '/';
+    m_groups.push(group);
+}
+
+void SettingsPrivate::clear()
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Remove);
+    SETTINGS_TRACE(TraceWrite) << "clear(), path: " << m_currentPath;
+    write(m_currentPath, NULL);
+}
+
+void SettingsPrivate::sync()
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Sync);
+    if (!backendAlive())
+        return;
+
+    flushWrites();
+    waitForRemovals();
+    ++m_stats.dconfSyncs;
+    m_backend->sync();
+    m_pendingWrites.clear();
+    m_outstandingWrites = false;
+    m_cache.publish();
+}
+
+void SettingsPrivate::syncForRead() const
+{
+    // only strict reads wait for dconf-service to acknowledge our writes,
+    // and there is nothing to wait for when none are outstanding
+    if (m_consistency == Settings::StrictConsistency && m_outstandingWrites)
+    {
+        ++m_stats.dconfSyncs;
+        m_backend->sync();
+        m_pendingWrites.clear();
+        m_outstandingWrites = false;
+    }
+}
+
+void SettingsPrivate::dropPendingWrites(const QByteArray &path) const
+{
+    if (!path.endsWith('/'))
+    {
+        m_pendingWrites.remove(path);
+        return;
+    }
+
+    QHash<QByteArray, QVariant>::iterator it = m_pendingWrites.begin();
+    while (it != m_pendingWrites.end())
+    {
+        if (it.key().startsWith(path))
+            it = m_pendingWrites.erase(it);
+        else
+            ++it;
+    }
+}
+
+// Collects the buffered keys below dir, relative to it.
+struct BufferedKeys
+{
+    const QByteArray *dir;
+    QStringList *keys;
+
+    static gboolean collect(const gchar *path, GVariant *, gpointer data)
+    {
+        BufferedKeys *self = static_cast<BufferedKeys *>(data);
+        if (g_str_has_prefix(path, self->dir->constData()))
+            *self->keys += QString::fromLatin1(path + self->dir->size());
+        return TRUE;
+    }
+};
+
+QStringList SettingsPrivate::pendingKeys(const QByteArray &dir) const
+{
+    QStringList result;
+
+    // describing would seal the buffer, so walk it instead
+    if (m_writeBuffer)
+    {
+        BufferedKeys keys = { &dir, &result };
+        dconf_changeset_all(m_writeBuffer, BufferedKeys::collect, &keys);
+    }
+
+    if (m_consistency != Settings::ReadOwnWritesConsistency)
+        return result;
+
+    QHash<QByteArray, QVariant>::const_iterator it;
+    for (it = m_pendingWrites.constBegin(); it != m_pendingWrites.constEnd(); ++it)
+    {
+        if (it.key().startsWith(dir))
+            result += QString::fromLatin1(it.key().constData() + dir.size());
+    }
+
+    return result;
+}
+
+QSettings::Status SettingsPrivate::status() const
+{
+    return QSettings::NoError; // FIXME: should we omit errors?
+}
+
+void SettingsPrivate::beginGroup(const QString &prefix)
+{
+    pushGroup(prefix, false);
+
+    SETTINGS_TRACE(TraceGroup) << "beginGroup, m_currentPath: " << m_currentPath;
+}
+
+void SettingsPrivate::endGroup()
+{
+    if (m_groups.isEmpty())
+    {
+        qWarning() << "endGroup() called with no groups";
+        return;
+    }
+
+    if (m_groups.top().array)
+    {
+        qWarning() << "endGroup() called on an array";
+        return;
+    }
+
+    m_currentPath.truncate(m_groups.pop().start);
+
+    SETTINGS_TRACE(TraceGroup) << "endGroup, m_currentPath: " << m_currentPath;
+}
+
+QString SettingsPrivate::group() const
+{
+    if (m_currentPath.size() == m_rootPath.size())
+        return QString();
+    return QString::fromLatin1(m_currentPath.constData() + m_rootPath.size(), m_currentPath.size() - m_rootPath.size() - 1);
+}
+
+// Size of the array at m_currentPath: its "size" key, as endArray() and
+// QSettings write it, or for arrays written without one the highest
+// numbered child group.
+int SettingsPrivate::arraySize()
+{
+    QVariant size;
+    if (lookup(m_currentPath + "size", &size))
+    {
+        bool ok;
+        int result = size.toInt(&ok);
+        if (ok && result >= 0)
+            return result;
+    }
+
+    int result = 0;
+    Q_FOREACH (QString group, childGroups())
+    {
+        bool ok;
+        int index = group.toInt(&ok);
+        if (ok)
+            result = qMax(result, index + 1);
+    }
+    return result;
+}
+
+int SettingsPrivate::beginReadArray(const QString &prefix)
+{
+    pushGroup(prefix, true);
+    int result = arraySize();
+
+    m_groups.top().indexStart = m_currentPath.size();
+    m_currentPath += "0/";
+
+    SETTINGS_TRACE(TraceGroup) << "beginReadArray, m_currentPath: " << m_currentPath;
+
+    return result;
+}
+
+void SettingsPrivate::beginWriteArray(const QString &prefix, int size)
+{
+    pushGroup(prefix, true);
+    m_groups.top().indexStart = m_currentPath.size();
+    m_groups.top().writing = true;
+    m_groups.top().size = qMax(size, -1);
+    m_currentPath += "0/";
+
+    SETTINGS_TRACE(TraceGroup) << "beginWriteArray, m_currentPath: " << m_currentPath;
+}
+
+void SettingsPrivate::endArray()
+{
+    if (m_groups.isEmpty())
+    {
+        qWarning() << "endArray() called with no arrays";
+        return;
+    }
+
+    if (!m_groups.top().array)
+    {
+        qWarning() << "endArray() called on a group";
+        return;
+    }
+
+    Group group = m_groups.pop();
+    if (group.writing && group.size >= 0)
+        write(m_currentPath.left(group.indexStart) + "size", QVariant(group.size));
+    m_currentPath.truncate(group.start);
+
+    SETTINGS_TRACE(TraceGroup) << "endArray, m_currentPath: " << m_currentPath;
+}
+
+void SettingsPrivate::setArrayIndex(int i)
+{
+    if (m_groups.isEmpty())
+    {
+        qWarning() << "setArrayIndex() called with no arrays";
+        return;
+    }
+
+    if (!m_groups.top().array)
+    {
+        qWarning() << "setArrayIndex() called on a group";
+        return;
+    }
+
+    Group &group = m_groups.top();
+    m_currentPath.truncate(group.indexStart);
+    m_currentPath += QByteArray::number(i) + '/';
+    if (group.writing)
+        group.size = qMax(group.size, i + 1);
+
+    SETTINGS_TRACE(TraceGroup) << "setArrayIndex, m_currentPath: " << m_currentPath;
+}
+
+// All elements of an array with one enumeration of its subtree; element i
+// maps the keys below "prefix/i/" to their values.
+QVector<QVariantHash> SettingsPrivate::readArray(const QString &prefix)
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Enumerate);
+    pushGroup(prefix, true);
+    QVector<QVariantHash> result(arraySize());
+
+    syncForRead();
+    watchForRead(m_currentPath);
+    QStringList keys;
+    m_index->allKeys(m_currentPath, QString(), &keys);
+    Q_FOREACH (const QString &key, pendingKeys(m_currentPath))
+    {
+        if (!keys.contains(key))
+            keys += key;
+    }
+
+    Q_FOREACH (const QString &key, keys)
+    {
+        int slash = key.indexOf(QLatin1Char('/'));
+        bool ok;
+        int index = key.left(slash).toInt(&ok);
+        if (slash <= 0 || !ok || index < 0 || index >= result.size())
+            continue;
+
+        QVariant value;
+        if (lookup(m_currentPath + key.toLatin1(), &value))
+            result[index].insert(key.mid(slash + 1), value);
+    }
+
+    m_currentPath.truncate(m_groups.pop().start);
+    return result;
+}
+
+QStringList SettingsPrivate::allKeys() const
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Enumerate);
+    syncForRead();
+    watchForRead(m_currentPath);
+
+    QString prefix = group();
+    if (!prefix.isEmpty())
+    {
+        prefix += QLatin1Char('/');
+    }
+    const QByteArray &path = m_currentPath;
+    QStringList result;
+    m_index->allKeys(path, prefix, &result);
+    dropRemoving(path, &result, prefix.size(), false);
+
+    Q_FOREACH (const QString &key, pendingKeys(path))
+    {
+        if (!result.contains(prefix + key))
+            result += prefix + key;
+    }
+
+    return result;
+}
+
+QStringList SettingsPrivate::childKeys() const
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Enumerate);
+    syncForRead();
+    watchForRead(m_currentPath);
+
+    const QByteArray &path = m_currentPath;
+    QStringList result = m_index->childKeys(path);
+    dropRemoving(path, &result, 0, false);
+
+    Q_FOREACH (const QString &key, pendingKeys(path))
+    {
+        if (!key.contains(QLatin1Char('/')) && !result.contains(key))
+            result += key;
+    }
+
+    return result;
+}
+
+QStringList SettingsPrivate::childGroups() const
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Enumerate);
+    syncForRead();
+    watchForRead(m_currentPath);
+
+    const QByteArray &path = m_currentPath;
+    QStringList result = m_index->childGroups(path);
+    dropRemoving(path, &result, 0, true);
+
+    Q_FOREACH (const QString &key, pendingKeys(path))
+    {
+        QString group = key.section(QLatin1Char('/'), 0, 0);
+        if (key.contains(QLatin1Char('/')) && !result.contains(group))
+            result += group;
+    }
+
+    return result;
+}
+
+bool SettingsPrivate::isWritable() const
+{
+    return m_backend->isWritable(m_currentPath);
+}
+
+void SettingsPrivate::setValue(const QString &key, const QVariant &value)
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::SetValue);
+    QByteArray path = m_currentPath + normalisedPath(key);
+    SETTINGS_TRACE(TraceWrite) << "setValue: path: " << path << ", value: " << value;
+    write(path, value);
+}
+
+void SettingsPrivate::write(const QByteArray &path, const QVariant &value)
+{
+    GVariantPtr val(encodeValue(value, m_storageFormat));
+    write(path, val.get());
+}
+
+// Writes value at path, or resets path when value is NULL. Inside a
+// transaction the change is only staged.
+void SettingsPrivate::write(const QByteArray &path, GVariant *value)
+{
+    if (value)
+        m_stats.bytesEncoded += g_variant_get_size(value);
+
+    if (m_changeset)
+    {
+        dconf_changeset_set(m_changeset, path.constData(), value);
+        return;
+    }
+
+    // only values are held back; a reset goes out after the values set
+    // before it, so nothing buffered can resurrect what it removes
+    if (m_writeDelay > 0 && value)
+    {
+        if (!m_writeBuffer)
+            m_writeBuffer = dconf_changeset_new();
+        if (dconf_changeset_get(m_writeBuffer, path.constData(), NULL))
+            ++m_stats.writesCoalesced;
+        // reads find it in the buffer; the cache learns it on the flush
+        dconf_changeset_set(m_writeBuffer, path.constData(), value);
+        if (!m_writeTimer.isActive())
+            m_writeTimer.start(m_writeDelay, q_ptr);
+        return;
+    }
+    flushWrites();
+
+    // a value must not be overtaken by an earlier removal
+    if (value && isRemoving(path))
+        waitForRemovals();
+
+    GErrorPtr err;
+    QByteArray tag;
+    bool ok = m_backend->write(path, value, &tag, err.out());
+
+    if (ok)
+    {
+        expectEcho(tag, path, value);
+        recordWrite(path, value, value != NULL);
+    }
+    else if (path.endsWith('/'))
+    {
+        m_cache.invalidatePrefix(path);
+        m_index->invalidate(path);
+    }
+    else
+    {
+        m_cache.invalidate(path);
+    }
+
+    if (err.isSet())
+        qWarning() << "writing" << path << "failed:" << err.message();
+}
+
+// Remembers a change we made, so that its notification can be told apart
+// from other processes' changes. A tagged change is recognised by its tag.
+// dconf does not tell the tags of fast writes, so an untagged key is
+// recognised by still holding the value we wrote when its notification
+// arrives; untagged directory resets are not recognised.
+void SettingsPrivate::expectEcho(const QByteArray &tag, const QByteArray &path, GVariant *value)
+{
+    // unwatched changes are never notified
+    if (!m_ignoreOwnChanges || !isWatched(path))
+        return;
+
+    if (!tag.isEmpty())
+    {
+        // a changeset is one change with one tag for all its paths
+        if (m_ownTags.isEmpty() || m_ownTags.last() != tag)
+            m_ownTags.append(tag);
+        return;
+    }
+
+    if (path.endsWith('/'))
+        return;
+
+    OwnWrite &write = m_ownWrites[path];
+    write.value = GVariantPtr::ref(value);
+    ++write.echoes;
+}
+
+// Whether a notification for the key at path, which now holds current,
+// reports a write of ours.
+bool SettingsPrivate::isEcho(const QByteArray &path, const GVariantPtr &current)
+{
+    QHash<QByteArray, OwnWrite>::iterator it = m_ownWrites.find(path);
+    if (it == m_ownWrites.end())
+        return false;
+
+    const GVariantPtr &written = it.value().value;
+    bool echo = written.isNull() ? current.isNull()
+                                 : !current.isNull() && g_variant_equal(written.get(), current.get());
+    if (!echo || --it.value().echoes <= 0)
+        m_ownWrites.erase(it);
+    return echo;
+}
+
+// Brings the cache and the pending writes in line with a change we made.
+void SettingsPrivate::recordWrite(const QByteArray &path, GVariant *value, bool fast)
+{
+    if (fast)
+        m_outstandingWrites = true;
+
+    if (value)
+    {
+        QVariant written = decodeValue(value);
+        if (isWatched(path))
+            m_cache.insert(path, true, written);
+        m_index->keyChanged(path, true);
+        if (fast)
+            m_pendingWrites.insert(path, written);
+        else
+            m_pendingWrites.remove(path);
+        return;
+    }
+
+    // a reset key may still have a system default, so just forget it
+    if (path.endsWith('/'))
+    {
+        m_cache.invalidatePrefix(path);
+        m_index->invalidate(path);
+    }
+    else
+    {
+        m_cache.invalidate(path);
+        updateIndex(path);
+    }
+    dropPendingWrites(path);
+}
+
+// Tells the index whether the key at path currently exists.
+void SettingsPrivate::updateIndex(const QByteArray &path)
+{
+    GVariantPtr val(m_backend->read(path));
+    m_index->keyChanged(path, !val.isNull());
+}
+
+void SettingsPrivate::beginTransaction()
+{
+    if (!m_changeset)
+        m_changeset = dconf_changeset_new();
+    ++m_transactionDepth;
+}
+
+bool SettingsPrivate::commit()
+{
+    if (!m_changeset)
+    {
+        qWarning() << "commit() called with no transaction";
+        return false;
+    }
+
+    if (--m_transactionDepth > 0)
+        return !m_transactionAborted;
+
+    if (m_transactionAborted)
+    {
+        discardTransaction();
+        return false;
+    }
+
+    DConfChangeset *changeset = m_changeset;
+    m_changeset = 0;
+
+    flushWrites();
+    bool ok = apply(changeset, "commit()");
+    dconf_changeset_unref(changeset);
+    finishStagedRemovals(ok);
+    return ok;
+}
+
+// Hands changeset to the backend in one go and updates the cache with it.
+bool SettingsPrivate::apply(DConfChangeset *changeset, const char *what)
+{
+    if (dconf_changeset_is_empty(changeset))
+        return true;
+
+    const gchar *prefix;
+    const gchar * const *paths;
+    GVariant * const *values;
+    guint n = dconf_changeset_describe(changeset, &prefix, &paths, &values);
+
+    for (guint i = 0; i < n && !m_removals.isEmpty(); ++i)
+    {
+        if (values[i] && isRemoving(QByteArray(prefix) + paths[i]))
+            waitForRemovals();
+    }
+
+    GErrorPtr err;
+    QByteArray tag;
+    bool ok = m_backend->change(changeset, &tag, err.out());
+
+    for (guint i = 0; i < n; ++i)
+    {
+        QByteArray path = QByteArray(prefix) + paths[i];
+        if (ok)
+        {
+            expectEcho(tag, path, values[i]);
+            recordWrite(path, values[i], true);
+        }
+        else if (path.endsWith('/'))
+        {
+            m_cache.invalidatePrefix(path);
+        }
+        else
+        {
+            m_cache.invalidate(path);
+        }
+    }
+
+    if (err.isSet())
+        qWarning() << what << "failed:" << err.message();
+    return ok;
+}
+
+// Writes out the values held back by the write delay.
+void SettingsPrivate::flushWrites()
+{
+    m_writeTimer.stop();
+    if (!m_writeBuffer)
+        return;
+
+    DConfChangeset *buffer = m_writeBuffer;
+    m_writeBuffer = 0;
+    SETTINGS_TRACE(TraceWrite) << "flushing" << dconf_changeset_describe(buffer, NULL, NULL, NULL) << "buffered writes";
+    apply(buffer, "writing buffered values");
+    dconf_changeset_unref(buffer);
+}
+
+void SettingsPrivate::rollback()
+{
+    if (!m_changeset)
+    {
+        qWarning() << "rollback() called with no transaction";
+        return;
+    }
+
+    if (--m_transactionDepth > 0)
+    {
+        // the enclosing transactions stay open but can only be rolled back;
+        // what they staged is gone already
+        m_transactionAborted = true;
+        dconf_changeset_unref(m_changeset);
+        m_changeset = dconf_changeset_new();
+        return;
+    }
+
+    discardTransaction();
+}
+
+void SettingsPrivate::discardTransaction()
+{
+    dconf_changeset_unref(m_changeset);
+    m_changeset = 0;
+    m_transactionDepth = 0;
+    m_transactionAborted = false;
+    finishStagedRemovals(false);
+}
+
+// Reports the removals staged in the transaction that just ended.
+void SettingsPrivate::finishStagedRemovals(bool ok)
+{
+    Q_FOREACH (int id, m_stagedRemovals)
+        QCoreApplication::postEvent(m_removalReceiver, new SettingsRemovalReceiver::FinishedEvent(id, ok, QByteArray()));
+    m_stagedRemovals.clear();
+}
+
+bool SettingsPrivate::inTransaction() const
+{
+    return m_changeset != 0;
+}
+
+// Looks path up in the open transaction, including resets of its parents.
+bool SettingsPrivate::lookupStaged(const QByteArray &path, bool *exists, QVariant *result) const
+{
+    GVariant *staged = NULL;
+    if (dconf_changeset_get(m_changeset, path.constData(), &staged))
+    {
+        GVariantPtr val(staged);
+        *exists = !val.isNull();
+        if (*exists)
+            *result = decodeValue(val.get());
+        return true;
+    }
+
+    for (int i = path.lastIndexOf('/'); i > 0; i = path.lastIndexOf('/', i - 1))
+    {
+        if (dconf_changeset_get(m_changeset, path.left(i + 1).constData(), NULL))
+        {
+            *exists = false;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool SettingsPrivate::read(const QByteArray &path, QVariant *result, gsize *size) const
+{
+    GVariantPtr val(m_backend->read(path));
+    if (val.isNull())
+        return false;
+
+    if (size)
+        *size = val.size();
+
+    *result = decodeValue(val.get());
+    return true;
+}
+
+bool SettingsPrivate::lookup(const QByteArray &path, QVariant *result) const
+{
+    bool exists;
+    if (!lookupLocal(path, &exists, result))
+    {
+        QElapsedTimer timer;
+        timer.start();
+        gsize size = 0;
+        exists = read(path, result, &size);
+        m_stats.bytesDecoded += size;
+        ++m_stats.coldReads;
+        m_stats.coldReadNsecs += timer.nsecsElapsed();
+        m_cache.fill(path, exists, *result);
+    }
+    return exists;
+}
+
+// Answers from staged, pending or cached values; returns false when only
+// dconf itself knows.
+bool SettingsPrivate::lookupLocal(const QByteArray &path, bool *exists, QVariant *result) const
+{
+    if (m_changeset && lookupStaged(path, exists, result))
+        return true;
+
+    GVariant *buffered = NULL;
+    if (m_writeBuffer && dconf_changeset_get(m_writeBuffer, path.constData(), &buffered))
+    {
+        GVariantPtr val(buffered);
+        *exists = true;
+        *result = decodeValue(val.get());
+        return true;
+    }
+
+    if (isRemoving(path))
+    {
+        *exists = false;
+        return true;
+    }
+
+    if (m_consistency == Settings::ReadOwnWritesConsistency)
+    {
+        QHash<QByteArray, QVariant>::const_iterator it = m_pendingWrites.constFind(path);
+        if (it != m_pendingWrites.constEnd())
+        {
+            *exists = true;
+            *result = it.value();
+            return true;
+        }
+    }
+
+    syncForRead();
+    watchForRead(path);
+
+    bool prefetched = false;
+    if (!m_cache.lookup(path, exists, result, &prefetched))
+        return false;
+
+    // count the first read of each prefetched value, the one it saved
+    if (prefetched && !m_prefetchUsed.contains(path))
+    {
+        m_prefetchUsed.insert(path);
+        ++m_stats.prefetchHits;
+    }
+    return true;
+}
+
+QVariant SettingsPrivate::value(const QString &key, const QVariant &defaultValue) const
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Value);
+    QByteArray path = m_currentPath + normalisedPath(key);
+    SETTINGS_TRACE(TraceRead) << "value(), path: " << path;
+
+    QVariant result;
+    return lookup(path, &result) ? result : defaultValue;
+}
+
+void SettingsPrivate::remove(const QString &key)
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Remove);
+    QByteArray path = m_currentPath + normalisedPath(key);
+    SETTINGS_TRACE(TraceWrite) << "remove(), path: " << path;
+    write(path, NULL);
+}
+
+int SettingsPrivate::removeAsync(const QStringList &keys)
+{
+    QSet<QByteArray> paths;
+    Q_FOREACH (const QString &key, keys)
+    {
+        QByteArray path = normalisedPath(key);
+        if (path.isEmpty())
+            continue;
+        paths.insert(m_currentPath + path + (key.endsWith(QLatin1Char('/')) ? "/" : ""));
+    }
+
+    // buffered values were set before the removal, and the index must
+    // know them to collapse it
+    flushWrites();
+    return startRemoval(collapseResets(paths));
+}
+
+int SettingsPrivate::clearAsync()
+{
+    return startRemoval(QList<QByteArray>() << m_currentPath);
+}
+
+// Replaces resets covering everything in a directory with a reset of the
+// directory, as far up as the application path. A directory with keys the
+// index may not list yet is never covered.
+QList<QByteArray> SettingsPrivate::collapseResets(const QSet<QByteArray> &paths)
+{
+    QSet<QByteArray> result = paths;
+    bool collapsed = true;
+    while (collapsed)
+    {
+        collapsed = false;
+
+        QSet<QByteArray> parents;
+        Q_FOREACH (const QByteArray &path, result)
+        {
+            if (path.size() > m_rootPath.size())
+                parents.insert(path.left(path.lastIndexOf('/', path.size() - 2) + 1));
+        }
+
+        Q_FOREACH (const QByteArray &dir, parents)
+        {
+            watchForRead(dir);
+            QStringList keys = m_index->childKeys(dir);
+            QStringList groups = m_index->childGroups(dir);
+            if (keys.isEmpty() && groups.isEmpty())
+                continue;
+
+            bool covered = !hasUnlistedKeys(dir);
+            Q_FOREACH (const QString &key, keys)
+                covered = covered && result.contains(dir + key.toLatin1());
+            Q_FOREACH (const QString &group, groups)
+                covered = covered && result.contains(dir + group.toLatin1() + '/');
+            if (!covered)
+                continue;
+
+            QSet<QByteArray>::iterator it = result.begin();
+            while (it != result.end())
+            {
+                if (it->startsWith(dir))
+                    it = result.erase(it);
+                else
+                    ++it;
+            }
+            result.insert(dir);
+            collapsed = true;
+        }
+    }
+    return result.toList();
+}
+
+// Whether keys below dir are staged, buffered or written without an
+// acknowledgement yet.
+bool SettingsPrivate::hasUnlistedKeys(const QByteArray &dir) const
+{
+    QStringList keys;
+    BufferedKeys collector = { &dir, &keys };
+    if (m_changeset)
+        dconf_changeset_all(m_changeset, BufferedKeys::collect, &collector);
+    if (m_writeBuffer)
+        dconf_changeset_all(m_writeBuffer, BufferedKeys::collect, &collector);
+    if (!keys.isEmpty())
+        return true;
+
+    QHash<QByteArray, QVariant>::const_iterator it;
+    for (it = m_pendingWrites.constBegin(); it != m_pendingWrites.constEnd(); ++it)
+    {
+        if (it.key().startsWith(dir))
+            return true;
+    }
+    return false;
+}
+
+// Hands the resets of paths to the removal thread. Until they are done,
+// reads and enumerations treat paths as removed.
+int SettingsPrivate::startRemoval(const QList<QByteArray> &paths)
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Remove);
+    int id = ++m_lastRemovalId;
+    SETTINGS_TRACE(TraceWrite) << "removal" << id << "of" << paths;
+
+    // a transaction applies them with everything else on commit()
+    if (m_changeset)
+    {
+        Q_FOREACH (const QByteArray &path, paths)
+            write(path, NULL);
+        m_stagedRemovals += id;
+        return id;
+    }
+
+    // buffered values were set before the removal
+    flushWrites();
+
+    DConfChangeset *changeset = dconf_changeset_new();
+    Removal removal;
+    removal.id = id;
+    Q_FOREACH (const QByteArray &path, paths)
+    {
+        dconf_changeset_set(changeset, path.constData(), NULL);
+        removal.paths += path;
+        dropPendingWrites(path);
+    }
+    m_removals += removal;
+
+    m_removalPool.start(new SettingsRemoval(m_backend, changeset, id, m_removalReceiver));
+    return id;
+}
+
+// The notification of the removal may have arrived before us; it was held
+// back then, see backendChanged().
+void SettingsPrivate::removalFinished(int id, bool ok, const QByteArray &error, const QByteArray &tag)
+{
+    if (!error.isEmpty())
+        qWarning() << "removal" << id << "failed:" << error;
+
+    if (ok && !tag.isEmpty() && m_ignoreOwnChanges)
+    {
+        bool arrived = false;
+        for (int i = 0; !arrived && i < m_heldNotifications.size(); ++i)
+        {
+            if (m_heldNotifications.at(i).tag == tag)
+            {
+                m_heldNotifications.removeAt(i);
+                ++m_stats.notifications;
+                ++m_stats.ownChangesIgnored;
+                arrived = true;
+            }
+        }
+        if (!arrived && !m_watched.isEmpty())
+            m_removalTags += tag;
+    }
+
+    if (!m_removals.isEmpty() && m_removals.first().id == id)
+    {
+        Removal removal = m_removals.takeFirst();
+        Q_FOREACH (const QByteArray &path, removal.paths)
+        {
+            // a reset key may still have a system default, so just forget it
+            if (path.endsWith('/'))
+            {
+                m_cache.invalidatePrefix(path);
+                m_index->invalidate(path);
+            }
+            else
+            {
+                m_cache.invalidate(path);
+                updateIndex(path);
+            }
+        }
+    }
+
+    // what is still held back was someone else's change
+    if (m_removals.isEmpty())
+    {
+        QList<HeldNotification> held;
+        qSwap(held, m_heldNotifications);
+        Q_FOREACH (const HeldNotification &notification, held)
+        {
+            QVarLengthArray<const char *, 16> changes;
+            Q_FOREACH (const QByteArray &change, notification.changes)
+                changes.append(change.constData());
+            changes.append(NULL);
+            backendChanged(notification.prefix.constData(), changes.constData(), notification.tag.constData());
+        }
+    }
+
+    Q_Q(Settings);
+    Q_EMIT q->removeFinished(id, ok);
+}
+
+bool SettingsPrivate::isRemoving(const QByteArray &path) const
+{
+    Q_FOREACH (const Removal &removal, m_removals)
+    {
+        Q_FOREACH (const QByteArray &removed, removal.paths)
+        {
+            if (path == removed || (removed.endsWith('/') && path.startsWith(removed)))
+                return true;
+        }
+    }
+    return false;
+}
+
+// Drops the names below dir, after skip characters, that are being removed.
+void SettingsPrivate::dropRemoving(const QByteArray &dir, QStringList *names, int skip, bool groups) const
+{
+    if (m_removals.isEmpty())
+        return;
+
+    QStringList::iterator it = names->begin();
+    while (it != names->end())
+    {
+        QByteArray path = dir + it->mid(skip).toLatin1();
+        if (isRemoving(groups ? path + '/' : path))
+            it = names->erase(it);
+        else
+            ++it;
+    }
+}
+
+// Blocks until every asynchronous removal is done and reported.
+void SettingsPrivate::waitForRemovals()
+{
+    if (m_removals.isEmpty())
+        return;
+
+    m_removalPool.waitForDone();
+    QCoreApplication::sendPostedEvents(m_removalReceiver, SettingsRemovalReceiver::finishedType());
+}
+
+bool SettingsPrivate::contains(const QString &key) const
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Contains);
+    QByteArray path = m_currentPath + normalisedPath(key);
+    SETTINGS_TRACE(TraceRead) << "contains(), path: " << path;
+
+    QVariant result;
+    return lookup(path, &result);
+}
+
+Settings::Key SettingsPrivate::key(const QString &key) const
+{
+    Settings::Key result;
+    QByteArray path = m_currentPath + normalisedPath(key);
+    if (dconf_is_key(path.constData(), NULL))
+        result.m_path = path;
+    else
+        qWarning() << "key(): invalid key" << path;
+    return result;
+}
+
+void SettingsPrivate::setValue(const Settings::Key &key, const QVariant &value)
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::SetValue);
+    if (key.isValid())
+        write(key.m_path, value);
+}
+
+QVariant SettingsPrivate::value(const Settings::Key &key, const QVariant &defaultValue) const
+{
+    if (!key.isValid())
+        return defaultValue;
+
+    QVariant result;
+    if (!onOwnerThread())
+        return lookupShared(key.m_path, &result) ? result : defaultValue;
+
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Value);
+    return lookup(key.m_path, &result) ? result : defaultValue;
+}
+
+bool SettingsPrivate::contains(const Settings::Key &key) const
+{
+    if (!key.isValid())
+        return false;
+
+    QVariant result;
+    if (!onOwnerThread())
+        return lookupShared(key.m_path, &result);
+
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Contains);
+    return lookup(key.m_path, &result);
+}
+
+bool SettingsPrivate::onOwnerThread() const
+{
+    return QThread::currentThread() == q_ptr->thread();
+}
+
+// The read path of other threads: the published cache, then dconf. What
+// they read is queued for the owning thread to add to the cache.
+bool SettingsPrivate::lookupShared(const QByteArray &path, QVariant *result) const
+{
+    bool exists;
+    if (m_rootWatched && m_cache.find(path, &exists, result))
+        return exists;
+
+    int generation = m_cache.generation();
+    exists = read(path, result);
+    if (m_rootWatched)
+        m_cache.submit(path, exists, *result, generation);
+    return exists;
+}
+
+// Reads and decodes one value of a bulk read; runs on any thread.
+class BulkReader
+{
+public:
+    typedef void result_type;
+
+    explicit BulkReader(SettingsBackend *backend)
+        : m_backend(backend)
+    {
+    }
+
+    void operator()(SettingsRead &read) const
+    {
+        GVariantPtr val(m_backend->read(read.path));
+        read.exists = !val.isNull();
+        read.size = val.size();
+        if (read.exists)
+            read.value = decodeValue(val.get());
+    }
+
+private:
+    SettingsBackend *m_backend;
+};
+
+// Below this many cold values, starting threads costs more than decoding.
+static const int ParallelReadThreshold = 256;
+
+// Adds the value of every read whose key exists to result. Values not
+// known locally are read in one batch, on several threads for large ones,
+// and enter the cache together.
+void SettingsPrivate::lookupMany(const QVector<SettingsRead> &reads, QVariantHash *result) const
+{
+    QVector<SettingsRead> misses;
+    Q_FOREACH (const SettingsRead &read, reads)
+    {
+        bool exists;
+        QVariant value;
+        if (!lookupLocal(read.path, &exists, &value))
+            misses.append(read);
+        else if (exists)
+            result->insert(read.key, value);
+    }
+
+    if (misses.isEmpty())
+        return;
+
+    if (misses.size() >= ParallelReadThreshold)
+    {
+        QtConcurrent::blockingMap(misses, BulkReader(m_backend));
+    }
+    else
+    {
+        BulkReader reader(m_backend);
+        for (int i = 0; i < misses.size(); ++i)
+            reader(misses[i]);
+    }
+
+    Q_FOREACH (const SettingsRead &read, misses)
+    {
+        m_stats.bytesDecoded += read.size;
+        if (read.exists)
+            result->insert(read.key, read.value);
+    }
+    m_cache.fill(misses);
+}
+
+// Fills the cache with the values below groups, relative to the
+// application path, or below all of it, on a pool thread. While one runs,
+// further groups are queued for it.
+void SettingsPrivate::prefetch(const QStringList &groups)
+{
+    QList<QByteArray> dirs;
+    Q_FOREACH (const QString &group, groups)
+    {
+        QByteArray path = normalisedPath(group);
+        dirs += path.isEmpty() ? m_rootPath : m_rootPath + path + '/';
+    }
+    if (dirs.isEmpty())
+        dirs += m_rootPath;
+
+    m_watchPinned = true;
+    updateWatches();
+
+    QMutexLocker locker(&m_prefetchMutex);
+    if (m_prefetching)
+    {
+        Q_FOREACH (const QByteArray &dir, dirs)
+        {
+            if (!m_prefetchQueue.contains(dir))
+                m_prefetchQueue += dir;
+        }
+        return;
+    }
+
+    m_prefetching = true;
+    m_prefetch = QtConcurrent::run(this, &SettingsPrivate::runPrefetch, dirs);
+}
+
+bool SettingsPrivate::waitForPrefetch(int msecs)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QMutexLocker locker(&m_prefetchMutex);
+    while (m_prefetching)
+    {
+        qint64 left = msecs < 0 ? 0 : msecs - timer.elapsed();
+        if (msecs >= 0 && left <= 0)
+            break;
+        m_prefetchDone.wait(&m_prefetchMutex, msecs < 0 ? ULONG_MAX : ulong(left));
+    }
+    bool done = !m_prefetching;
+    m_stats.prefetchWaitNsecs += timer.nsecsElapsed();
+    return done;
+}
+
+// Runs on a pool thread, so it only uses the backend and the cache. Each
+// directory is handed to the cache in one go, provided nothing changed
+// while it was read; otherwise it is read again.
+void SettingsPrivate::runPrefetch(const QList<QByteArray> &dirs)
+{
+    static const int Attempts = 3;
+
+    QElapsedTimer timer;
+    timer.start();
+    quint64 keys = 0;
+    BulkReader reader(m_backend);
+
+    QList<QByteArray> pending = dirs;
+    for (;;)
+    {
+        if (pending.isEmpty())
+        {
+            QMutexLocker locker(&m_prefetchMutex);
+            if (m_prefetchQueue.isEmpty())
+            {
+                m_prefetchedKeys += keys;
+                m_prefetchNsecs += timer.nsecsElapsed();
+                m_prefetching = false;
+                m_prefetchDone.wakeAll();
+                return;
+            }
+            qSwap(pending, m_prefetchQueue);
+        }
+
+        QByteArray dir = pending.takeFirst();
+        for (int attempt = 0; attempt < Attempts; ++attempt)
+        {
+            QVector<SettingsRead> reads;
+            QList<QByteArray> subdirs;
+            GStrvPtr names(m_backend->list(dir));
+            for (gchar **name = names.begin(); name != names.end(); ++name)
+            {
+                if (dconf_is_rel_dir(*name, NULL))
+                {
+                    subdirs += dir + *name;
+                }
+                else if (dconf_is_rel_key(*name, NULL))
+                {
+                    reads.append(SettingsRead());
+                    reads.last().path = dir + *name;
+                }
+            }
+
+            int generation = m_cache.generation();
+            for (int i = 0; i < reads.size(); ++i)
+                reader(reads[i]);
+
+            bool unchanged = m_cache.generation() == generation;
+            if (unchanged)
+            {
+                m_cache.submit(reads, generation, true);
+                keys += reads.size();
+            }
+            if (unchanged || attempt == Attempts - 1)
+            {
+                pending += subdirs;
+                break;
+            }
+        }
+    }
+}
+
+QVariantHash SettingsPrivate::readGroup(const QString &prefix, bool recursive) const
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Enumerate);
+    QByteArray dir = m_currentPath + normalisedPath(prefix);
+    if (!dir.endsWith('/'))
+        dir += '/';
+
+    syncForRead();
+    watchForRead(dir);
+    QStringList keys;
+    if (recursive)
+        m_index->allKeys(dir, QString(), &keys);
+    else
+        keys = m_index->childKeys(dir);
+
+    Q_FOREACH (const QString &key, pendingKeys(dir))
+    {
+        if ((recursive || !key.contains(QLatin1Char('/'))) && !keys.contains(key))
+            keys += key;
+    }
+
+    QVector<SettingsRead> reads(keys.size());
+    for (int i = 0; i < keys.size(); ++i)
+    {
+        reads[i].key = keys[i];
+        reads[i].path = dir + keys[i].toLatin1();
+    }
+
+    QVariantHash result;
+    result.reserve(keys.size());
+    lookupMany(reads, &result);
+    return result;
+}
+
+QVariantHash SettingsPrivate::values(const QStringList &keys) const
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Value);
+    QVector<SettingsRead> reads(keys.size());
+    for (int i = 0; i < keys.size(); ++i)
+    {
+        reads[i].key = keys[i];
+        reads[i].path = m_currentPath + normalisedPath(keys[i]);
+    }
+
+    QVariantHash result;
+    result.reserve(keys.size());
+    lookupMany(reads, &result);
+    return result;
+}
+
+QString SettingsPrivate::organizationName() const
 {
     return m_organizationName;
 }
 
-QString SettingsPrivate::applicationName() const
+QString SettingsPrivate::applicationName() const
+{
+    return m_applicationName;
+}
+
+quint64 SettingsPrivate::cacheHitCount() const
+{
+    return m_cache.hits();
+}
+
+quint64 SettingsPrivate::cacheMissCount() const
+{
+    return m_cache.misses();
+}
+
+Settings::Statistics SettingsPrivate::statistics() const
+{
+    Settings::Statistics result = m_stats;
+    result.cacheHits = m_cache.hits() - m_cacheHitsBase;
+    result.cacheMisses = m_cache.misses() - m_cacheMissesBase;
+
+    SettingsPrivate *self = const_cast<SettingsPrivate *>(this);
+    QMutexLocker locker(&self->m_prefetchMutex);
+    result.prefetchedKeys = m_prefetchedKeys;
+    result.prefetchNsecs = m_prefetchNsecs;
+    // each value read ahead saved one cold read, at the latency observed
+    // for those
+    if (result.coldReads)
+        result.prefetchSavedNsecs = qint64(result.prefetchHits * result.coldReadNsecs / result.coldReads)
+                                    - qint64(result.prefetchWaitNsecs);
+    return result;
+}
+
+void SettingsPrivate::resetStatistics()
+{
+    m_stats = Settings::Statistics();
+    m_cacheHitsBase = m_cache.hits();
+    m_cacheMissesBase = m_cache.misses();
+}
+
+void SettingsPrivate::setLatencyTracking(bool enabled)
+{
+    m_latencyTracking = enabled;
+}
+
+bool SettingsPrivate::latencyTracking() const
+{
+    return m_latencyTracking;
+}
+
+void SettingsPrivate::setReadConsistency(Settings::ReadConsistency consistency)
+{
+    m_consistency = consistency;
+}
+
+Settings::ReadConsistency SettingsPrivate::readConsistency() const
+{
+    return m_consistency;
+}
+
+void SettingsPrivate::setStorageFormat(Settings::StorageFormat format)
+{
+    m_storageFormat = format;
+}
+
+Settings::StorageFormat SettingsPrivate::storageFormat() const
+{
+    return m_storageFormat;
+}
+
+Settings::Backend SettingsPrivate::backend() const
+{
+    return m_backendType;
+}
+
+static void deleteByteArray(gpointer data)
+{
+    delete static_cast<QByteArray *>(data);
+}
+
+// Wraps a in an "ay" GVariant that shares its data instead of copying it.
+static GVariant *newByteString(const QByteArray &a)
+{
+    QByteArray *data = new QByteArray(a);
+    return g_variant_new_from_data(G_VARIANT_TYPE_BYTESTRING, data->constData(), data->size(), TRUE, deleteByteArray, data);
+}
+
+// A QSettings string cannot hold a NUL byte: as a GVariant string it would
+// end there.
+static bool fitsInString(const QByteArray &a)
+{
+    return !memchr(a.constData(), '\0', a.size());
+}
+
+// Returns a floating reference. NativeStorage maps the common types onto
+// GVariant types; strings keep the QSettings escaping so they decode the
+// same way whatever the storage format, and anything without a native
+// counterpart falls back to the QSettings string encoding.
+// NativeStorage stores binary data as "ay", and types only QDataStream can
+// serialise as "(say)" holding the type name and the stream. StringStorage
+// only does so for data with NUL bytes, which its strings would truncate.
+static GVariant *encodeValue(const QVariant &v, Settings::StorageFormat format)
+{
+    if (v.type() == QVariant::ByteArray)
+    {
+        QByteArray a = v.toByteArray();
+        if (format == Settings::NativeStorage || !fitsInString(a))
+            return newByteString(a);
+    }
+
+    if (format == Settings::NativeStorage)
+    {
+        switch (int(v.type()))
+        {
+        case QVariant::Invalid:
+            return g_variant_new_maybe(G_VARIANT_TYPE_VARIANT, NULL);
+
+        case QVariant::Bool:
+            return g_variant_new_boolean(v.toBool());
+
+        case QVariant::Int:
+            return g_variant_new_int32(v.toInt());
+
+        case QVariant::UInt:
+            return g_variant_new_uint32(v.toUInt());
+
+        case QVariant::LongLong:
+            return g_variant_new_int64(v.toLongLong());
+
+        case QVariant::ULongLong:
+            return g_variant_new_uint64(v.toULongLong());
+
+        case QVariant::Double:
+            return g_variant_new_double(v.toDouble());
+
+        case QVariant::StringList:
+        {
+            GVariantBuilder builder;
+            g_variant_builder_init(&builder, G_VARIANT_TYPE_STRING_ARRAY);
+            Q_FOREACH (const QString &str, v.toStringList())
+                g_variant_builder_add(&builder, "s", str.toUtf8().constData());
+            return g_variant_builder_end(&builder);
+        }
+
+        case QVariant::List:
+        {
+            GVariantBuilder builder;
+            g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
+            Q_FOREACH (const QVariant &item, v.toList())
+                g_variant_builder_add(&builder, "v", encodeValue(item, format));
+            return g_variant_builder_end(&builder);
+        }
+
+        case QVariant::Map:
+        case QVariant::Hash:
+        {
+            GVariantBuilder builder;
+            g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+            if (v.type() == QVariant::Map)
+            {
+                QVariantMap map = v.toMap();
+                for (QVariantMap::const_iterator it = map.constBegin(); it != map.constEnd(); ++it)
+                    g_variant_builder_add(&builder, "{sv}", it.key().toUtf8().constData(), encodeValue(it.value(), format));
+            }
+            else
+            {
+                QVariantHash hash = v.toHash();
+                for (QVariantHash::const_iterator it = hash.constBegin(); it != hash.constEnd(); ++it)
+                    g_variant_builder_add(&builder, "{sv}", it.key().toUtf8().constData(), encodeValue(it.value(), format));
+            }
+            return g_variant_builder_end(&builder);
+        }
+
+#ifndef QT_NO_GEOM_VARIANT
+        case QVariant::Rect:
+        {
+            QRect r = qvariant_cast<QRect>(v);
+            return g_variant_new("(iiii)", r.x(), r.y(), r.width(), r.height());
+        }
+#endif // !QT_NO_GEOM_VARIANT
+
+        default:
+            break;
+        }
+    }
+
+    switch (int(v.type()))
+    {
+    case QVariant::Invalid:
+    case QVariant::String:
+    case QVariant::LongLong:
+    case QVariant::ULongLong:
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::Bool:
+    case QVariant::Double:
+    case QVariant::KeySequence:
+    case QVariant::ByteArray:
+#ifndef QT_NO_GEOM_VARIANT
+    case QVariant::Rect:
+    case QVariant::Size:
+    case QVariant::Point:
+#endif // !QT_NO_GEOM_VARIANT
+        break;
+
+    default:
+    {
+#ifndef QT_NO_DATASTREAM
+        QByteArray a;
+        {
+            QDataStream s(&a, QIODevice::WriteOnly);
+            s.setVersion(QDataStream::Qt_4_0);
+            s << v;
+        }
+        if (format == Settings::NativeStorage || !fitsInString(a))
+            return g_variant_new("(s@ay)", v.typeName() ? v.typeName() : "", newByteString(a));
+#endif
+        break;
+    }
+    }
+
+    return g_variant_new_string(variantToString(v).toUtf8().constData());
+}
+
+// Decodes both the native GVariant types written with NativeStorage and the
+// QSettings style strings written with StringStorage.
+static QVariant decodeValue(GVariant *value)
 {
-    return m_applicationName;
+    switch (g_variant_classify(value))
+    {
+    case G_VARIANT_CLASS_STRING:
+    {
+        gsize length;
+        const char *str = g_variant_get_string(value, &length);
+        return stringToVariant(str, int(length));
+    }
+
+    case G_VARIANT_CLASS_BOOLEAN:
+        return QVariant(bool(g_variant_get_boolean(value)));
+
+    case G_VARIANT_CLASS_BYTE:
+        return QVariant(uint(g_variant_get_byte(value)));
+
+    case G_VARIANT_CLASS_INT16:
+        return QVariant(int(g_variant_get_int16(value)));
+
+    case G_VARIANT_CLASS_UINT16:
+        return QVariant(uint(g_variant_get_uint16(value)));
+
+    case G_VARIANT_CLASS_INT32:
+        return QVariant(int(g_variant_get_int32(value)));
+
+    case G_VARIANT_CLASS_UINT32:
+        return QVariant(uint(g_variant_get_uint32(value)));
+
+    case G_VARIANT_CLASS_INT64:
+        return QVariant(qlonglong(g_variant_get_int64(value)));
+
+    case G_VARIANT_CLASS_UINT64:
+        return QVariant(qulonglong(g_variant_get_uint64(value)));
+
+    case G_VARIANT_CLASS_DOUBLE:
+        return QVariant(double(g_variant_get_double(value)));
+
+    case G_VARIANT_CLASS_VARIANT:
+    {
+        GVariantPtr inner(g_variant_get_variant(value));
+        return decodeValue(inner.get());
+    }
+
+    case G_VARIANT_CLASS_MAYBE:
+    {
+        GVariantPtr inner(g_variant_get_maybe(value));
+        return inner.isNull() ? QVariant() : decodeValue(inner.get());
+    }
+
+    case G_VARIANT_CLASS_ARRAY:
+    {
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_BYTESTRING))
+        {
+            gsize size;
+            const char *data = static_cast<const char *>(g_variant_get_fixed_array(value, &size, 1));
+            // the only copy on the way out of dconf
+            return QVariant(QByteArray(data, int(size)));
+        }
+
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING_ARRAY))
+        {
+            gsize length;
+            const gchar **strv = g_variant_get_strv(value, &length);
+            QStringList result;
+            for (gsize i = 0; i < length; ++i)
+                result += QString::fromUtf8(strv[i]);
+            g_free(strv);
+            return QVariant(result);
+        }
+
+        GVariantIter iter;
+        g_variant_iter_init(&iter, value);
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_VARDICT))
+        {
+            QVariantMap result;
+            const gchar *key;
+            GVariant *item;
+            while (g_variant_iter_next(&iter, "{&sv}", &key, &item))
+            {
+                GVariantPtr owned(item);
+                result.insert(QString::fromUtf8(key), decodeValue(item));
+            }
+            return QVariant(result);
+        }
+
+        QVariantList result;
+        GVariant *item;
+        while ((item = g_variant_iter_next_value(&iter)))
+        {
+            GVariantPtr owned(item);
+            result += decodeValue(item);
+        }
+        return QVariant(result);
+    }
+
+    case G_VARIANT_CLASS_TUPLE:
+    {
+#ifndef QT_NO_DATASTREAM
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE("(say)")))
+        {
+            GVariantPtr bytes(g_variant_get_child_value(value, 1));
+            gsize size;
+            const char *data = static_cast<const char *>(g_variant_get_fixed_array(bytes.get(), &size, 1));
+            QVariant result;
+            {
+                // the stream reads straight from the GVariant's buffer
+                QByteArray a = QByteArray::fromRawData(data, int(size));
+                QDataStream stream(a);
+                stream.setVersion(QDataStream::Qt_4_0);
+                stream >> result;
+            }
+            return result;
+        }
+#endif // !QT_NO_DATASTREAM
+#ifndef QT_NO_GEOM_VARIANT
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE("(iiii)")))
+        {
+            gint32 x, y, w, h;
+            g_variant_get(value, "(iiii)", &x, &y, &w, &h);
+            return QVariant(QRect(x, y, w, h));
+        }
+#endif // !QT_NO_GEOM_VARIANT
+        break;
+    }
+
+    default:
+        break;
+    }
+
+    return QVariant();
 }
 
 // taken from Qt source code (src/corelib/io/qsettings.cpp).
@@ -571,118 +4639,683 @@ static QString variantToString(const QVariant &v)
 }
 
 
-// taken from Qt source code (src/corelib/io/qsettings.cpp).
-// Copyright (C) 2013 Digia Plc and/or its subsidiary(-ies).
-// license: LGPL
-static QVariant stringToVariant(const QString &s)
+// Latin1 bytes of the UTF-8 text [s, s + len), as QString::toLatin1() gives.
+static QByteArray utf8ToLatin1(const char *s, int len)
+{
+    for (int i = 0; i < len; ++i)
+    {
+        if (uchar(s[i]) >= 0x80)
+            return QString::fromUtf8(s, len).toLatin1();
+    }
+    return QByteArray(s, len);
+}
+
+// Converts the UTF-8 text [s, s + len) like QString::toInt(), 0 on failure.
+static int parseArg(const char *s, int len)
+{
+    for (int i = 0; i < len; ++i)
+    {
+        if (uchar(s[i]) >= 0x80)
+            return QString::fromUtf8(s, len).toInt();
+    }
+
+    // QChar::isSpace() for ASCII: \t to \r and space
+    while (len > 0 && ((*s >= 9 && *s <= 13) || *s == ' '))
+    {
+        ++s;
+        --len;
+    }
+    while (len > 0 && ((s[len - 1] >= 9 && s[len - 1] <= 13) || s[len - 1] == ' '))
+        --len;
+    if (len == 0)
+        return 0;
+
+    bool negative = false;
+    if (*s == '+' || *s == '-')
+    {
+        negative = *s == '-';
+        ++s;
+        --len;
+        if (len == 0)
+            return 0;
+    }
+
+    qlonglong n = 0;
+    for (; len > 0; ++s, --len)
+    {
+        if (*s < '0' || *s > '9')
+            return 0;
+        n = n * 10 + (*s - '0');
+        if (n > qlonglong(INT_MAX) + 1)
+            return 0;
+    }
+
+    if (negative)
+        n = -n;
+    if (n > INT_MAX || n < INT_MIN)
+        return 0;
+    return int(n);
+}
+
+// Parses the arguments of "@Type(a b ...)" in place, s[idx] being the '('.
+// Splits exactly like the splitArgs() in qsettings.cpp: a space ends an
+// argument, and a ')' emits the argument so far without starting a new one.
+// Returns false unless there are exactly count arguments.
+static bool parseGeometry(const char *s, int len, int idx, int *args, int count)
 {
-    if (s.startsWith(QLatin1Char('@')))
+    QVarLengthArray<char, 32> item;
+    int n = 0;
+
+    for (++idx; idx < len; ++idx)
     {
-        if (s.endsWith(QLatin1Char(')')))
+        char c = s[idx];
+        if (c == ')' || c == ' ')
         {
-            if (s.startsWith(QLatin1String("@ByteArray(")))
-            {
-                return QVariant(s.toLatin1().mid(11, s.size() - 12));
-            }
-            else if (s.startsWith(QLatin1String("@Variant(")))
+            if (n < count)
+                args[n] = parseArg(item.constData(), item.size());
+            ++n;
+            if (c == ' ')
+                item.clear();
+        }
+        else
+        {
+            item.append(c);
+        }
+    }
+
+    return n == count;
+}
+
+// Decodes a QSettings style value string in one pass over its UTF-8 bytes.
+// Gives exactly what stringToVariant() in qsettings.cpp gives for the same
+// text.
+static QVariant stringToVariant(const char *s, int len)
+{
+    if (len >= 2 && s[0] == '@')
+    {
+        if (s[len - 1] == ')')
+        {
+            switch (s[1])
             {
+            case 'B':
+                if (len >= 11 && memcmp(s, "@ByteArray(", 11) == 0)
+                    return QVariant(utf8ToLatin1(s + 11, len - 12));
+                break;
+
+            case 'V':
+                if (len >= 9 && memcmp(s, "@Variant(", 9) == 0)
+                {
 #ifndef QT_NO_DATASTREAM
-                QByteArray a(s.toLatin1().mid(9));
-                QDataStream stream(&a, QIODevice::ReadOnly);
-                stream.setVersion(QDataStream::Qt_4_0);
-                QVariant result;
-                stream >> result;
-                return result;
+                    QByteArray a(utf8ToLatin1(s + 9, len - 10));
+                    QDataStream stream(&a, QIODevice::ReadOnly);
+                    stream.setVersion(QDataStream::Qt_4_0);
+                    QVariant result;
+                    stream >> result;
+                    return result;
 #else
-                Q_ASSERT(!"QSettings: Cannot load custom types without QDataStream support");
+                    Q_ASSERT(!"QSettings: Cannot load custom types without QDataStream support");
 #endif
-#ifndef QT_NO_GEOM_VARIANT
-            }
-            else if (s.startsWith(QLatin1String("@Rect(")))
-            {
-                QStringList args = splitArgs(s, 5);
+                }
+                break;
 
-                if (args.size() == 4)
+#ifndef QT_NO_GEOM_VARIANT
+            case 'R':
+                if (len >= 6 && memcmp(s, "@Rect(", 6) == 0)
                 {
-                    return QVariant(QRect(args[0].toInt(), args[1].toInt(), args[2].toInt(), args[3].toInt()));
+                    int args[4];
+                    if (parseGeometry(s, len, 5, args, 4))
+                        return QVariant(QRect(args[0], args[1], args[2], args[3]));
                 }
-            }
-            else if (s.startsWith(QLatin1String("@Size(")))
-            {
-                QStringList args = splitArgs(s, 5);
+                break;
 
-                if (args.size() == 2)
+            case 'S':
+                if (len >= 6 && memcmp(s, "@Size(", 6) == 0)
                 {
-                    return QVariant(QSize(args[0].toInt(), args[1].toInt()));
+                    int args[2];
+                    if (parseGeometry(s, len, 5, args, 2))
+                        return QVariant(QSize(args[0], args[1]));
                 }
-            }
-            else if (s.startsWith(QLatin1String("@Point(")))
-            {
-                QStringList args = splitArgs(s, 6);
+                break;
 
-                if (args.size() == 2)
+            case 'P':
+                if (len >= 7 && memcmp(s, "@Point(", 7) == 0)
                 {
-                    return QVariant(QPoint(args[0].toInt(), args[1].toInt()));
+                    int args[2];
+                    if (parseGeometry(s, len, 6, args, 2))
+                        return QVariant(QPoint(args[0], args[1]));
                 }
+                break;
+#endif // !QT_NO_GEOM_VARIANT
+
+            case 'I':
+                if (len == 10 && memcmp(s, "@Invalid()", 10) == 0)
+                    return QVariant();
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        if (s[1] == '@')
+            return QVariant(QString::fromUtf8(s + 1, len - 1));
+    }
+
+    return QVariant(QString::fromUtf8(s, len));
+}
+
+// Typed codecs used by Settings::get() and Settings::set(). They read the
+// dconf GVariant, native or legacy string, straight into T; the generic
+// one goes through decodeValue() for the rarer encodings. Values get()
+// finds in the cache go through convertVariant(), which follows the same
+// rules.
+
+template <typename T>
+static bool convertVariant(const QVariant &v, T *result)
+{
+    if (!v.isValid() || !v.canConvert<T>())
+        return false;
+    *result = qvariant_cast<T>(v);
+    return true;
+}
+
+// Parses a whole string the way QString::toLongLong() would.
+static bool parseInteger(const char *str, qlonglong *result)
+{
+    gchar *end;
+    errno = 0;
+    gint64 n = g_ascii_strtoll(str, &end, 10);
+    if (end == str || errno)
+        return false;
+    while (g_ascii_isspace(*end))
+        ++end;
+    if (*end)
+        return false;
+    *result = n;
+    return true;
+}
+
+// Parses a whole string as a double, in the C locale.
+static bool parseDouble(const char *str, double *result)
+{
+    char *end;
+    double d = g_ascii_strtod(str, &end);
+    if (end == str)
+        return false;
+    while (g_ascii_isspace(*end))
+        ++end;
+    if (*end)
+        return false;
+    *result = d;
+    return true;
+}
+
+// Same rules as QVariant's string to bool conversion.
+static bool parseBool(const char *str)
+{
+    return !(!*str || qstrcmp(str, "0") == 0 || g_ascii_strcasecmp(str, "false") == 0);
+}
+
+static bool decodeInteger(GVariant *value, qlonglong *result)
+{
+    switch (g_variant_classify(value))
+    {
+    case G_VARIANT_CLASS_BOOLEAN:
+        *result = g_variant_get_boolean(value) ? 1 : 0;
+        return true;
+    case G_VARIANT_CLASS_BYTE:
+        *result = g_variant_get_byte(value);
+        return true;
+    case G_VARIANT_CLASS_INT16:
+        *result = g_variant_get_int16(value);
+        return true;
+    case G_VARIANT_CLASS_UINT16:
+        *result = g_variant_get_uint16(value);
+        return true;
+    case G_VARIANT_CLASS_INT32:
+        *result = g_variant_get_int32(value);
+        return true;
+    case G_VARIANT_CLASS_UINT32:
+        *result = g_variant_get_uint32(value);
+        return true;
+    case G_VARIANT_CLASS_INT64:
+        *result = g_variant_get_int64(value);
+        return true;
+    case G_VARIANT_CLASS_UINT64:
+        *result = qlonglong(g_variant_get_uint64(value));
+        return true;
+    case G_VARIANT_CLASS_DOUBLE:
+        *result = qRound64(g_variant_get_double(value));
+        return true;
+    case G_VARIANT_CLASS_STRING:
+        return parseInteger(g_variant_get_string(value, NULL), result);
+    default:
+        return false;
+    }
+}
+
+// decodeInteger() for a decoded value.
+static bool convertInteger(const QVariant &v, qlonglong *result)
+{
+    switch (v.type())
+    {
+    case QVariant::String:
+        return parseInteger(v.toString().toUtf8().constData(), result);
+    case QVariant::Double:
+        *result = qRound64(v.toDouble());
+        return true;
+    case QVariant::Bool:
+        *result = v.toBool() ? 1 : 0;
+        return true;
+    case QVariant::ByteArray:
+        return false;
+    default:
+        break;
+    }
+
+    bool ok = false;
+    qlonglong n = v.toLongLong(&ok);
+    if (ok)
+        *result = n;
+    return ok;
+}
+
+static bool convertVariant(const QVariant &v, int *result)
+{
+    qlonglong n;
+    if (!convertInteger(v, &n))
+        return false;
+    *result = int(n);
+    return true;
+}
+
+static bool convertVariant(const QVariant &v, uint *result)
+{
+    qlonglong n;
+    if (!convertInteger(v, &n))
+        return false;
+    *result = uint(n);
+    return true;
+}
+
+static bool convertVariant(const QVariant &v, qlonglong *result)
+{
+    return convertInteger(v, result);
+}
+
+static bool convertVariant(const QVariant &v, bool *result)
+{
+    if (v.type() == QVariant::String)
+    {
+        *result = parseBool(v.toString().toUtf8().constData());
+        return true;
+    }
+
+    qlonglong n;
+    if (!convertInteger(v, &n))
+        return false;
+    *result = n != 0;
+    return true;
+}
+
+static bool convertVariant(const QVariant &v, double *result)
+{
+    if (v.type() == QVariant::Double)
+    {
+        *result = v.toDouble();
+        return true;
+    }
+    if (v.type() == QVariant::String)
+        return parseDouble(v.toString().toUtf8().constData(), result);
+
+    qlonglong n;
+    if (!convertInteger(v, &n))
+        return false;
+    *result = double(n);
+    return true;
+}
+
+#ifndef QT_NO_GEOM_VARIANT
+// Reads the arguments of a legacy "@Rect(...)"-like string value.
+static bool parseLegacyGeometry(GVariant *value, const char *tag, int *args, int count)
+{
+    if (!g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+        return false;
+
+    gsize length;
+    const char *str = g_variant_get_string(value, &length);
+    int tagLength = qstrlen(tag);
+    if (int(length) <= tagLength || str[length - 1] != ')' || memcmp(str, tag, tagLength) != 0)
+        return false;
+
+    return parseGeometry(str, int(length), tagLength - 1, args, count);
+}
+#endif // !QT_NO_GEOM_VARIANT
+
+template <typename T>
+struct SettingsCodec
+{
+    static bool decode(GVariant *value, T *result)
+    {
+        return convertVariant(decodeValue(value), result);
+    }
+
+    static GVariant *encode(const T &value, Settings::StorageFormat format)
+    {
+        return encodeValue(QVariant::fromValue(value), format);
+    }
+};
+
+template <>
+struct SettingsCodec<int>
+{
+    static bool decode(GVariant *value, int *result)
+    {
+        qlonglong n;
+        if (!decodeInteger(value, &n))
+            return false;
+        *result = int(n);
+        return true;
+    }
+
+    static GVariant *encode(const int &value, Settings::StorageFormat format)
+    {
+        if (format == Settings::NativeStorage)
+            return g_variant_new_int32(value);
+        return g_variant_new_string(QByteArray::number(value).constData());
+    }
+};
+
+template <>
+struct SettingsCodec<uint>
+{
+    static bool decode(GVariant *value, uint *result)
+    {
+        qlonglong n;
+        if (!decodeInteger(value, &n))
+            return false;
+        *result = uint(n);
+        return true;
+    }
+
+    static GVariant *encode(const uint &value, Settings::StorageFormat format)
+    {
+        if (format == Settings::NativeStorage)
+            return g_variant_new_uint32(value);
+        return g_variant_new_string(QByteArray::number(value).constData());
+    }
+};
+
+template <>
+struct SettingsCodec<qlonglong>
+{
+    static bool decode(GVariant *value, qlonglong *result)
+    {
+        return decodeInteger(value, result);
+    }
+
+    static GVariant *encode(const qlonglong &value, Settings::StorageFormat format)
+    {
+        if (format == Settings::NativeStorage)
+            return g_variant_new_int64(value);
+        return g_variant_new_string(QByteArray::number(value).constData());
+    }
+};
+
+template <>
+struct SettingsCodec<bool>
+{
+    static bool decode(GVariant *value, bool *result)
+    {
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+        {
+            *result = parseBool(g_variant_get_string(value, NULL));
+            return true;
+        }
+
+        qlonglong n;
+        if (!decodeInteger(value, &n))
+            return false;
+        *result = n != 0;
+        return true;
+    }
+
+    static GVariant *encode(const bool &value, Settings::StorageFormat format)
+    {
+        if (format == Settings::NativeStorage)
+            return g_variant_new_boolean(value);
+        return g_variant_new_string(value ? "true" : "false");
+    }
+};
+
+template <>
+struct SettingsCodec<double>
+{
+    static bool decode(GVariant *value, double *result)
+    {
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_DOUBLE))
+        {
+            *result = g_variant_get_double(value);
+            return true;
+        }
+
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+            return parseDouble(g_variant_get_string(value, NULL), result);
+
+        qlonglong n;
+        if (!decodeInteger(value, &n))
+            return false;
+        *result = double(n);
+        return true;
+    }
 
-#endif
+    static GVariant *encode(const double &value, Settings::StorageFormat format)
+    {
+        if (format == Settings::NativeStorage)
+            return g_variant_new_double(value);
+        return encodeValue(QVariant(value), format);
+    }
+};
+
+template <>
+struct SettingsCodec<QString>
+{
+    static bool decode(GVariant *value, QString *result)
+    {
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+        {
+            const char *str = g_variant_get_string(value, NULL);
+            if (str[0] != '@')
+            {
+                *result = QString::fromUtf8(str);
+                return true;
             }
-            else if (s == QLatin1String("@Invalid()"))
+            if (str[1] == '@')
             {
-                return QVariant();
+                *result = QString::fromUtf8(str + 1);
+                return true;
             }
-
         }
 
-        if (s.startsWith(QLatin1String("@@")))
+        return convertVariant(decodeValue(value), result);
+    }
+
+    static GVariant *encode(const QString &value, Settings::StorageFormat format)
+    {
+        Q_UNUSED(format);
+        QByteArray utf8 = value.toUtf8();
+        if (utf8.startsWith('@'))
+            utf8.prepend('@');
+        return g_variant_new_string(utf8.constData());
+    }
+};
+
+template <>
+struct SettingsCodec<QStringList>
+{
+    static bool decode(GVariant *value, QStringList *result)
+    {
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING_ARRAY))
         {
-            return QVariant(s.mid(1));
+            gsize length;
+            const gchar **strv = g_variant_get_strv(value, &length);
+            result->clear();
+            for (gsize i = 0; i < length; ++i)
+                result->append(QString::fromUtf8(strv[i]));
+            g_free(strv);
+            return true;
         }
+
+        return convertVariant(decodeValue(value), result);
     }
 
-    return QVariant(s);
-}
+    static GVariant *encode(const QStringList &value, Settings::StorageFormat format)
+    {
+        return encodeValue(QVariant(value), format);
+    }
+};
 
-// taken from Qt source code (src/corelib/io/qsettings.cpp).
-// Copyright (C) 2013 Digia Plc and/or its subsidiary(-ies).
-// license: LGPL
-static QStringList splitArgs(const QString &s, int idx)
+template <>
+struct SettingsCodec<QByteArray>
 {
-    int l = s.length();
-    Q_ASSERT(l > 0);
-    Q_ASSERT(s.at(idx) == QLatin1Char('('));
-    Q_ASSERT(s.at(l - 1) == QLatin1Char(')'));
+    static bool decode(GVariant *value, QByteArray *result)
+    {
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE_BYTESTRING))
+        {
+            gsize size;
+            const char *data = static_cast<const char *>(g_variant_get_fixed_array(value, &size, 1));
+            *result = QByteArray(data, int(size));
+            return true;
+        }
 
-    QStringList result;
-    QString item;
+        return convertVariant(decodeValue(value), result);
+    }
+
+    static GVariant *encode(const QByteArray &value, Settings::StorageFormat format)
+    {
+        return encodeValue(QVariant(value), format);
+    }
+};
 
-    for (++idx; idx < l; ++idx)
+#ifndef QT_NO_GEOM_VARIANT
+template <>
+struct SettingsCodec<QRect>
+{
+    static bool decode(GVariant *value, QRect *result)
     {
-        QChar c = s.at(idx);
-        if (c == QLatin1Char(')'))
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE("(iiii)")))
         {
-            Q_ASSERT(idx == l - 1);
-            result.append(item);
+            gint32 x, y, w, h;
+            g_variant_get(value, "(iiii)", &x, &y, &w, &h);
+            *result = QRect(x, y, w, h);
+            return true;
         }
-        else if (c == QLatin1Char(' '))
+
+        int args[4];
+        if (parseLegacyGeometry(value, "@Rect(", args, 4))
         {
-            result.append(item);
-            item.clear();
+            *result = QRect(args[0], args[1], args[2], args[3]);
+            return true;
         }
-        else
+
+        return convertVariant(decodeValue(value), result);
+    }
+
+    static GVariant *encode(const QRect &value, Settings::StorageFormat format)
+    {
+        if (format == Settings::NativeStorage)
+            return g_variant_new("(iiii)", value.x(), value.y(), value.width(), value.height());
+        return encodeValue(QVariant(value), format);
+    }
+};
+
+template <>
+struct SettingsCodec<QSize>
+{
+    static bool decode(GVariant *value, QSize *result)
+    {
+        int args[2];
+        if (parseLegacyGeometry(value, "@Size(", args, 2))
         {
-            item.append(c);
+            *result = QSize(args[0], args[1]);
+            return true;
         }
+
+        return convertVariant(decodeValue(value), result);
     }
 
-    return result;
+    static GVariant *encode(const QSize &value, Settings::StorageFormat format)
+    {
+        return encodeValue(QVariant(value), format);
+    }
+};
+
+template <>
+struct SettingsCodec<QPoint>
+{
+    static bool decode(GVariant *value, QPoint *result)
+    {
+        int args[2];
+        if (parseLegacyGeometry(value, "@Point(", args, 2))
+        {
+            *result = QPoint(args[0], args[1]);
+            return true;
+        }
+
+        return convertVariant(decodeValue(value), result);
+    }
+
+    static GVariant *encode(const QPoint &value, Settings::StorageFormat format)
+    {
+        return encodeValue(QVariant(value), format);
+    }
+};
+#endif // !QT_NO_GEOM_VARIANT
+
+template <typename T>
+bool SettingsPrivate::get(const char *key, T *result) const
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::Value);
+    QByteArray path = m_currentPath + key;
+
+    bool exists;
+    QVariant cached;
+    if (lookupLocal(path, &exists, &cached))
+        return exists && convertVariant(cached, result);
+
+    QElapsedTimer coldTimer;
+    coldTimer.start();
+    GVariantPtr val(m_backend->read(path));
+    ++m_stats.coldReads;
+    if (val.isNull())
+    {
+        m_stats.coldReadNsecs += coldTimer.nsecsElapsed();
+        m_cache.fill(path, false, QVariant());
+        return false;
+    }
+
+    // the cache keeps what value() would return, so later reads of any
+    // type hit it
+    m_stats.bytesDecoded += val.size();
+    m_cache.fill(path, true, decodeValue(val.get()));
+    bool ok = SettingsCodec<T>::decode(val.get(), result);
+    m_stats.coldReadNsecs += coldTimer.nsecsElapsed();
+    return ok;
 }
 
+template <typename T>
+void SettingsPrivate::set(const char *key, const T &value)
+{
+    OperationTimer timer(&m_stats, m_latencyTracking, Settings::Statistics::SetValue);
+    QByteArray path = m_currentPath + key;
+    GVariantPtr val(SettingsCodec<T>::encode(value, m_storageFormat));
+    write(path, val.get());
+}
 
 
 Settings::Settings(QObject *parent)
     : QObject(parent)
-    , d_ptr(new SettingsPrivate(
+    , d_ptr(new SettingsPrivate(this,
 #ifdef Q_OS_MAC
         QCoreApplication::organizationDomain().isEmpty()
             ? (QLatin1String("org/") + QCoreApplication::organizationName())
@@ -692,13 +5325,19 @@ Settings::Settings(QObject *parent)
             ? QCoreApplication::organizationDomain().replace(QLatin1Char('.'), QLatin1Char('/'))
             : (QLatin1String("org/") + QCoreApplication::organizationName()) ,
 #endif
-        QCoreApplication::applicationName()))
+        QCoreApplication::applicationName(), DefaultBackend))
 {
 }
 
 Settings::Settings(const QString &organization, const QString &application, QObject *parent)
     : QObject(parent)
-    , d_ptr(new SettingsPrivate(QLatin1String("org/") + organization, application))
+    , d_ptr(new SettingsPrivate(this, QLatin1String("org/") + organization, application, DefaultBackend))
+{
+}
+
+Settings::Settings(const QString &organization, const QString &application, Backend backend, QObject *parent)
+    : QObject(parent)
+    , d_ptr(new SettingsPrivate(this, QLatin1String("org/") + organization, application, backend))
 {
 }
 
@@ -750,10 +5389,10 @@ int Settings::beginReadArray(const QString& prefix)
     return d->beginReadArray(prefix);
 }
 
-void Settings::beginWriteArray(const QString& prefix)
+void Settings::beginWriteArray(const QString& prefix, int size)
 {
     Q_D(Settings);
-    return d->beginWriteArray(prefix);
+    return d->beginWriteArray(prefix, size);
 }
 
 void Settings::endArray()
@@ -768,6 +5407,36 @@ void Settings::setArrayIndex(int i)
     return d->setArrayIndex(i);
 }
 
+QVector<QVariantHash> Settings::readArray(const QString &prefix)
+{
+    Q_D(Settings);
+    return d->readArray(prefix);
+}
+
+void Settings::prefetch(const QStringList &groups)
+{
+    Q_D(Settings);
+    d->prefetch(groups);
+}
+
+bool Settings::waitForPrefetch(int msecs)
+{
+    Q_D(Settings);
+    return d->waitForPrefetch(msecs);
+}
+
+QVariantHash Settings::readGroup(const QString &prefix, bool recursive) const
+{
+    Q_D(const Settings);
+    return d->readGroup(prefix, recursive);
+}
+
+QVariantHash Settings::values(const QStringList &keys) const
+{
+    Q_D(const Settings);
+    return d->values(keys);
+}
+
 QStringList Settings::allKeys() const
 {
     Q_D(const Settings);
@@ -810,6 +5479,18 @@ void Settings::remove(const QString &key)
     d->remove(key);
 }
 
+int Settings::removeAsync(const QStringList &keys)
+{
+    Q_D(Settings);
+    return d->removeAsync(keys);
+}
+
+int Settings::clearAsync()
+{
+    Q_D(Settings);
+    return d->clearAsync();
+}
+
 bool Settings::contains(const QString &key) const
 {
     Q_D(const Settings);
@@ -828,4 +5509,254 @@ QString Settings::applicationName() const
     return d->applicationName();
 }
 
+quint64 Settings::cacheHitCount() const
+{
+    Q_D(const Settings);
+    return d->cacheHitCount();
+}
+
+quint64 Settings::cacheMissCount() const
+{
+    Q_D(const Settings);
+    return d->cacheMissCount();
+}
+
+Settings::Statistics Settings::statistics() const
+{
+    Q_D(const Settings);
+    return d->statistics();
+}
+
+void Settings::resetStatistics()
+{
+    Q_D(Settings);
+    d->resetStatistics();
+}
+
+void Settings::setLatencyTracking(bool enabled)
+{
+    Q_D(Settings);
+    d->setLatencyTracking(enabled);
+}
+
+bool Settings::latencyTracking() const
+{
+    Q_D(const Settings);
+    return d->latencyTracking();
+}
+
+void Settings::setReadConsistency(ReadConsistency consistency)
+{
+    Q_D(Settings);
+    d->setReadConsistency(consistency);
+}
+
+Settings::ReadConsistency Settings::readConsistency() const
+{
+    Q_D(const Settings);
+    return d->readConsistency();
+}
+
+Settings::Key Settings::key(const QString &key) const
+{
+    Q_D(const Settings);
+    return d->key(key);
+}
+
+void Settings::setValue(const Key &key, const QVariant &value)
+{
+    Q_D(Settings);
+    d->setValue(key, value);
+}
+
+QVariant Settings::value(const Key &key, const QVariant &defaultValue) const
+{
+    Q_D(const Settings);
+    return d->value(key, defaultValue);
+}
+
+bool Settings::contains(const Key &key) const
+{
+    Q_D(const Settings);
+    return d->contains(key);
+}
+
+template <typename T>
+T Settings::get(const Setting<T> &setting) const
+{
+    Q_D(const Settings);
+    T result;
+    return d->get(setting.key, &result) ? result : setting.defaultValue;
+}
+
+template <typename T>
+void Settings::set(const Setting<T> &setting, const T &value)
+{
+    Q_D(Settings);
+    d->set(setting.key, value);
+}
+
+#define LXQT_SETTINGS_INSTANTIATE(T) \
+    template T Settings::get<T>(const Setting<T> &) const; \
+    template void Settings::set<T>(const Setting<T> &, const T &);
+
+LXQT_SETTINGS_INSTANTIATE(bool)
+LXQT_SETTINGS_INSTANTIATE(int)
+LXQT_SETTINGS_INSTANTIATE(uint)
+LXQT_SETTINGS_INSTANTIATE(qlonglong)
+LXQT_SETTINGS_INSTANTIATE(double)
+LXQT_SETTINGS_INSTANTIATE(QString)
+LXQT_SETTINGS_INSTANTIATE(QStringList)
+LXQT_SETTINGS_INSTANTIATE(QByteArray)
+#ifndef QT_NO_GEOM_VARIANT
+LXQT_SETTINGS_INSTANTIATE(QRect)
+LXQT_SETTINGS_INSTANTIATE(QSize)
+LXQT_SETTINGS_INSTANTIATE(QPoint)
+#endif // !QT_NO_GEOM_VARIANT
+
+#undef LXQT_SETTINGS_INSTANTIATE
+
+void Settings::beginTransaction()
+{
+    Q_D(Settings);
+    d->beginTransaction();
+}
+
+bool Settings::commit()
+{
+    Q_D(Settings);
+    return d->commit();
+}
+
+void Settings::rollback()
+{
+    Q_D(Settings);
+    d->rollback();
+}
+
+bool Settings::inTransaction() const
+{
+    Q_D(const Settings);
+    return d->inTransaction();
+}
+
+void Settings::setStorageFormat(StorageFormat format)
+{
+    Q_D(Settings);
+    d->setStorageFormat(format);
+}
+
+Settings::StorageFormat Settings::storageFormat() const
+{
+    Q_D(const Settings);
+    return d->storageFormat();
+}
+
+Settings::Backend Settings::backend() const
+{
+    Q_D(const Settings);
+    return d->backend();
+}
+
+void Settings::setChangeInterval(int msecs)
+{
+    Q_D(Settings);
+    d->setChangeInterval(msecs);
+}
+
+int Settings::changeInterval() const
+{
+    Q_D(const Settings);
+    return d->changeInterval();
+}
+
+void Settings::setWriteDelay(int msecs)
+{
+    Q_D(Settings);
+    d->setWriteDelay(msecs);
+}
+
+int Settings::writeDelay() const
+{
+    Q_D(const Settings);
+    return d->writeDelay();
+}
+
+void Settings::setIgnoreOwnChanges(bool ignore)
+{
+    Q_D(Settings);
+    d->setIgnoreOwnChanges(ignore);
+}
+
+bool Settings::ignoreOwnChanges() const
+{
+    Q_D(const Settings);
+    return d->ignoreOwnChanges();
+}
+
+bool Settings::watch(const QString &keyOrPrefix, QObject *receiver, const char *slot)
+{
+    Q_D(Settings);
+    return d->watch(keyOrPrefix, receiver, slot);
+}
+
+void Settings::unwatch(const QString &keyOrPrefix, QObject *receiver, const char *slot)
+{
+    Q_D(Settings);
+    d->unwatch(keyOrPrefix, receiver, slot);
+}
+
+void Settings::connectNotify(const char *signal)
+{
+    Q_D(Settings);
+    QObject::connectNotify(signal);
+    d->updateWatches();
+}
+
+void Settings::disconnectNotify(const char *signal)
+{
+    Q_D(Settings);
+    QObject::disconnectNotify(signal);
+    d->updateWatches();
+}
+
+void Settings::timerEvent(QTimerEvent *event)
+{
+    Q_D(Settings);
+    if (!d->timerEvent(event->timerId()))
+        QObject::timerEvent(event);
+}
+
+
+SettingsBatch::SettingsBatch(Settings &settings)
+    : m_settings(&settings)
+{
+    m_settings->beginTransaction();
+}
+
+SettingsBatch::~SettingsBatch()
+{
+    if (m_settings)
+        m_settings->commit();
+}
+
+bool SettingsBatch::commit()
+{
+    if (!m_settings)
+        return false;
+
+    bool ok = m_settings->commit();
+    m_settings = 0;
+    return ok;
+}
+
+void SettingsBatch::rollback()
+{
+    if (!m_settings)
+        return;
+
+    m_settings->rollback();
+    m_settings = 0;
+}
+
 } // namespace LxQt
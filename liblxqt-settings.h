@@ -25,20 +25,86 @@
 #include <QString>
 #include <QStringList>
 #include <QSettings>
+#include <QVector>
 
 namespace LxQt
 {
 
 class SettingsPrivate;
 
+// Describes a typed setting once, e.g.
+//     static const LxQt::Setting<int> IconSize = { "iconSize", 24 };
+// key is relative to the current group and must already be a valid
+// relative dconf key.
+template <typename T>
+struct Setting
+{
+    const char *key;
+    T defaultValue;
+};
+
 class Settings: public QObject
 {
     Q_OBJECT
 
 public:
+    enum ReadConsistency
+    {
+        StrictConsistency,          // wait until dconf-service acknowledged our writes (default)
+        ReadOwnWritesConsistency,   // serve our unacknowledged writes locally, never wait
+        EventualConsistency         // never wait, whatever dconf currently has
+    };
+
+    // How setValue() stores values. Both formats are always readable, so
+    // switching to NativeStorage migrates keys as they get written.
+    // StringStorage writes what QSettings would, except for byte arrays and
+    // QDataStream types containing NUL bytes, which a string cannot hold:
+    // those are binary ("ay"/"(say)") as in NativeStorage.
+    enum StorageFormat
+    {
+        StringStorage,  // QSettings style "@Type(...)" strings (default)
+        NativeStorage   // typed GVariants: b, i, u, x, t, d, as, av, a{sv}, ay, (iiii), (say)
+    };
+
+    // Where the settings are stored. Backends are shared by all Settings
+    // objects of the process that use them.
+    enum Backend
+    {
+        DefaultBackend,     // LXQT_SETTINGS_BACKEND ("dconf", "memory" or "ini"), else dconf
+        DConfBackend,
+        MemoryBackend,      // in process and lost at exit, for tests and benchmarks
+        IniBackend          // a QSettings INI file, for systems without dconf
+    };
+
+    // A key resolved once, against the group current when Settings::key()
+    // created it. It holds the validated dconf path, so passing it to
+    // value(), setValue() or contains() skips path building altogether.
+    // Only use it with the Settings object that created it.
+    //
+    // value() and contains() taking a Key may be called from any thread
+    // while the Settings object exists. They read, lock-free, the cache as
+    // its owning thread last published it, from its event loop or sync(),
+    // and see what dconf has, not this object's open transaction or its
+    // unacknowledged writes. Everything else, key() included, must
+    // be called from the thread the object lives in.
+    class Key
+    {
+    public:
+        Key() {}
+
+        bool isValid() const { return !m_path.isEmpty(); }
+        QByteArray path() const { return m_path; }
+
+    private:
+        friend class SettingsPrivate;
+        QByteArray m_path;
+    };
+
     explicit Settings(QObject *parent = 0); // Uses QCoreApplication
     explicit Settings(const QString &organization, const QString &application,
                       QObject *parent = 0);
+    Settings(const QString &organization, const QString &application, Backend backend,
+             QObject *parent = 0);
     ~Settings();
 
     void clear();
@@ -49,10 +115,16 @@ public:
     void endGroup();
     QString group() const;
 
+    // Like QSettings, endArray() stores the array size in a "size" key, the
+    // larger of the size given here and the highest index set plus one, so
+    // beginReadArray() reads one key. Arrays without it are counted.
     int beginReadArray(const QString& prefix);
-    void beginWriteArray(const QString& prefix);
+    void beginWriteArray(const QString& prefix, int size = -1);
     void endArray();
     void setArrayIndex(int i);
+    // Every element of an array at once, element i holding the keys below
+    // "prefix/i/" relative to it.
+    QVector<QVariantHash> readArray(const QString &prefix);
 
     QStringList allKeys() const;
     QStringList childKeys() const;
@@ -65,11 +137,171 @@ public:
     void remove(const QString &key);
     bool contains(const QString &key) const;
 
+    // remove() and clear() without waiting for dconf-service: the resets
+    // are applied on a worker thread, in order, and removeFinished()
+    // reports each call by the id returned here. keys are relative to the
+    // current group, those ending with '/' name groups. When keys cover
+    // everything in a group, the group is reset as a whole instead. Reads
+    // and enumerations see the keys as removed at once; sync() waits until
+    // all removals are done. Inside a transaction the resets are staged,
+    // and removeFinished() follows commit(), or rollback() with ok false.
+    int removeAsync(const QStringList &keys);
+    int clearAsync();
+
+    // Bulk reads with at most one sync and one enumeration. readGroup()
+    // returns the keys of the group prefix, relative to the current group,
+    // with their values; recursive adds those of its subgroups as
+    // "sub/key". values() returns those of keys that exist. Large groups are
+    // decoded on several threads.
+    QVariantHash readGroup(const QString &prefix, bool recursive = false) const;
+    QVariantHash values(const QStringList &keys) const;
+
+    // Reads and decodes the groups (relative to the application path, not
+    // the current group), or with none the whole application, into the
+    // cache on a pool thread, so later reads find them warm. Setting
+    // LXQT_SETTINGS_PREFETCH to "1"/"all" or to a comma separated list of
+    // groups does this at construction. Groups asked for while a prefetch
+    // runs are added to it. waitForPrefetch() returns whether the prefetch
+    // finished within msecs, -1 waiting as long as needed.
+    void prefetch(const QStringList &groups = QStringList());
+    bool waitForPrefetch(int msecs = -1);
+
+    Key key(const QString &key) const;
+    void setValue(const Key &key, const QVariant &value);
+    QVariant value(const Key &key, const QVariant &defaultValue = QVariant()) const;
+    bool contains(const Key &key) const;
+
+    // Typed access that decodes straight from dconf without a QVariant. T is
+    // one of bool, int, uint, qlonglong, double, QString, QStringList,
+    // QByteArray, QRect, QSize or QPoint.
+    template <typename T> T get(const Setting<T> &setting) const;
+    template <typename T> void set(const Setting<T> &setting, const T &value);
+
     QString organizationName() const;
     QString applicationName() const;
 
+    // read cache counters, mainly useful for profiling
+    quint64 cacheHitCount() const;
+    quint64 cacheMissCount() const;
+
+    // Counters since construction or resetStatistics(). Calls made from
+    // other threads than the owning one are not counted.
+    struct Statistics
+    {
+        Statistics();
+
+        enum Operation
+        {
+            Value,          // value(), values(), get() and the Key overloads
+            SetValue,       // setValue() and set()
+            Contains,
+            Remove,         // remove() and clear()
+            Enumerate,      // allKeys(), childKeys(), childGroups(), readGroup(), readArray()
+            Sync,
+            OperationCount
+        };
+
+        enum { LatencyBuckets = 16 };
+
+        quint64 calls[OperationCount];
+        // latency[op][i] counts calls that took less than 256 << i ns (and
+        // at least 256 << (i - 1)); the last bucket holds the slower ones.
+        // Only filled while latency tracking is on.
+        quint64 latency[OperationCount][LatencyBuckets];
+        quint64 bytesEncoded;   // serialised size of the GVariants written
+        quint64 bytesDecoded;   // serialised size of the GVariants read
+        quint64 dconfSyncs;     // dconf_client_sync() calls, ours and the reads'
+        quint64 notifications;  // dconf change notifications for this application
+        quint64 cacheHits;
+        quint64 cacheMisses;
+        // single values read from dconf on a cache miss, and the time they
+        // took, decoding included
+        quint64 coldReads;
+        quint64 coldReadNsecs;
+        quint64 prefetchedKeys;     // values the prefetch put in the cache
+        quint64 prefetchNsecs;      // time the prefetch took, off this thread
+        quint64 prefetchHits;       // first reads answered by a prefetched value
+        quint64 prefetchWaitNsecs;  // time spent in waitForPrefetch()
+        // prefetchHits reads at the average cold read latency, minus the
+        // waits; 0 until a cold read was timed
+        qint64 prefetchSavedNsecs;
+        quint64 writesCoalesced;    // buffered values replaced before a flush
+        quint64 ownChangesIgnored;  // notifications of our own changes dropped
+    };
+
+    Statistics statistics() const;
+    void resetStatistics();
+    // Timing costs two clock reads per call, so it is off by default.
+    void setLatencyTracking(bool enabled);
+    bool latencyTracking() const;
+
+    void setReadConsistency(ReadConsistency consistency);
+    ReadConsistency readConsistency() const;
+
+    // Collects setValue(), remove() and clear() until commit(), which applies
+    // them to dconf as one changeset. Reads see the staged values, the key
+    // enumerations only see committed ones. Transactions nest; only the
+    // outermost commit() writes. A rollback() at any depth aborts the whole
+    // transaction: what it staged is dropped and the remaining commit()
+    // calls write nothing and return false.
+    void beginTransaction();
+    bool commit();
+    void rollback();
+    bool inTransaction() const;
+
+    void setStorageFormat(StorageFormat format);
+    StorageFormat storageFormat() const;
+
+    Backend backend() const;
+
+    // keysChanged() lists the changed keys relative to the application
+    // path; reset directories end with '/', a reset of the whole
+    // application is "/". With a non-zero interval, changes arriving within
+    // that many milliseconds of the first are delivered together, as one
+    // keysChanged() and one changed() carrying their common prefix. The
+    // default, 0, emits both for every dconf notification.
+    //
+    // dconf is only watched while something listens: the whole application
+    // while changed() or keysChanged() are connected, otherwise just the
+    // keys and prefixes passed to watch(). Reads and enumerations watch the
+    // whole application too, so that the cache can answer them, until
+    // they have stopped for ten seconds.
+    void setChangeInterval(int msecs);
+    int changeInterval() const;
+
+    // With a non-zero delay, setValue() keeps values in memory for up to
+    // that many milliseconds and then writes the latest value of each key
+    // as one changeset, so a key set many times in a row costs a single
+    // dconf write and notification. sync(), remove(), clear(), commit()
+    // and destruction write the buffer out first. Reads and enumerations
+    // see buffered values. The default, 0, writes every value at once.
+    void setWriteDelay(int msecs);
+    int writeDelay() const;
+
+    // By default changes made through this object are not reported back
+    // to it by changed(), keysChanged() and watches; only other objects
+    // and processes see them. Changes of other Settings objects in this
+    // process are always reported.
+    void setIgnoreOwnChanges(bool ignore);
+    bool ignoreOwnChanges() const;
+
+    // Calls slot on receiver when keyOrPrefix, relative to the current
+    // group, changes. A prefix ending with '/', or an empty one, matches
+    // every key below it. The slot takes either no argument or a QString,
+    // the changed key as keysChanged() reports it. Watches are delivered
+    // together with keysChanged(), so they follow the change interval too.
+    bool watch(const QString &keyOrPrefix, QObject *receiver, const char *slot);
+    void unwatch(const QString &keyOrPrefix, QObject *receiver, const char *slot = 0);
+
 Q_SIGNALS:
     void changed(QString);
+    void keysChanged(const QStringList &keys);
+    void removeFinished(int id, bool ok);
+
+protected:
+    void connectNotify(const char *signal);
+    void disconnectNotify(const char *signal);
+    void timerEvent(QTimerEvent *event);
 
 private:
     Q_DISABLE_COPY(Settings)
@@ -77,6 +309,21 @@ private:
     Q_DECLARE_PRIVATE_D(d_ptr, Settings)
 };
 
+// Scoped transaction: commits when it goes out of scope unless rolled back.
+class SettingsBatch
+{
+public:
+    explicit SettingsBatch(Settings &settings);
+    ~SettingsBatch();
+
+    bool commit();
+    void rollback();
+
+private:
+    Q_DISABLE_COPY(SettingsBatch)
+    Settings *m_settings;
+};
+
 } // namespace LxQt
 
 #endif // LIBLXQT_SETTINGS_H
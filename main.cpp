@@ -2,6 +2,9 @@
 #include "liblxqt-settings.h"
 
 #include <QDebug>
+#include <QRect>
+#include <QSize>
+#include <QPoint>
 
 
 int main(int argc, char **argv)
@@ -23,6 +26,11 @@ int main(int argc, char **argv)
         settings.setValue("TestInt", 123);
         settings.setValue("TestBool", true);
         settings.setValue("TestFloat", 123.45);
+        settings.setValue("TestRect", QRect(1, 2, 3, 4));
+        settings.setValue("TestSize", QSize(5, 6));
+        settings.setValue("TestPoint", QPoint(-7, 8));
+        settings.setValue("TestByteArray", QByteArray("\x01@ByteArray()\x00", 14));
+        settings.setValue("TestEscaped", "@Rect(1 2 3 4)");
         qDebug() << "group: " << settings.group();
         settings.endGroup();
         settings.beginGroup("/testGroup2/testGroup3/");
@@ -42,6 +50,11 @@ int main(int argc, char **argv)
         qDebug() <<"read TestInt: " << settings.value("TestInt").toInt();
         qDebug() <<"read TestBool: " << settings.value("TestBool").toBool();
         qDebug() <<"read TestFloat: " << settings.value("TestFloat").toFloat();
+        qDebug() <<"read TestRect: " << settings.value("TestRect").toRect();
+        qDebug() <<"read TestSize: " << settings.value("TestSize").toSize();
+        qDebug() <<"read TestPoint: " << settings.value("TestPoint").toPoint();
+        qDebug() <<"read TestByteArray: " << settings.value("TestByteArray").toByteArray().toHex();
+        qDebug() <<"read TestEscaped: " << settings.value("TestEscaped");
         qDebug() <<"read testGroup3/TestStr: " << settings.value("testGroup3/TestStr").toString();
         settings.endGroup();
     }
@@ -59,6 +72,11 @@ int main(int argc, char **argv)
         settings.setValue("TestInt", 123);
         settings.setValue("TestBool", true);
         settings.setValue("TestFloat", 123.45);
+        settings.setValue("TestRect", QRect(1, 2, 3, 4));
+        settings.setValue("TestSize", QSize(5, 6));
+        settings.setValue("TestPoint", QPoint(-7, 8));
+        settings.setValue("TestByteArray", QByteArray("\x01@ByteArray()\x00", 14));
+        settings.setValue("TestEscaped", "@Rect(1 2 3 4)");
         qDebug() << "group: " << settings.group();
         settings.endGroup();
         settings.beginGroup("/testGroup2/testGroup3/");
@@ -78,6 +96,11 @@ int main(int argc, char **argv)
         qDebug() <<"read TestInt: " << settings.value("TestInt").toInt();
         qDebug() <<"read TestBool: " << settings.value("TestBool").toBool();
         qDebug() <<"read TestFloat: " << settings.value("TestFloat").toFloat();
+        qDebug() <<"read TestRect: " << settings.value("TestRect").toRect();
+        qDebug() <<"read TestSize: " << settings.value("TestSize").toSize();
+        qDebug() <<"read TestPoint: " << settings.value("TestPoint").toPoint();
+        qDebug() <<"read TestByteArray: " << settings.value("TestByteArray").toByteArray().toHex();
+        qDebug() <<"read TestEscaped: " << settings.value("TestEscaped");
         qDebug() <<"read testGroup3/TestStr: " << settings.value("testGroup3/TestStr").toString();
         settings.endGroup();
     }
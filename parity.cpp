@@ -0,0 +1,310 @@
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+#include <QStringList>
+#include <QRect>
+#include <QSize>
+#include <QPoint>
+
+#include "liblxqt-settings.h"
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Checks that StringStorage is QSettings' own encoding, bit for bit, in
+// both directions:
+//   - the string LxQt::Settings stores for a value is the one QSettings
+//     writes to an INI file for it;
+//   - what LxQt::Settings decodes from the string QSettings wrote is what
+//     QSettings itself reads back from its file.
+// Everything goes through the INI backend in a temporary directory, so no
+// dconf session is needed. Exits with 1 if any value differs.
+//
+// It also checks that get<T>() answers the same from the cache as from
+// the backend, for strings it may or may not parse as T.
+
+static const char *Organization = "lxde";
+static const char *Application = "settings-parity";
+
+static void removeRecursively(const QString &path)
+{
+    QFileInfo info(path);
+    if (info.isDir() && !info.isSymLink())
+    {
+        QDir dir(path);
+        Q_FOREACH (const QString &entry, dir.entryList(QDir::AllEntries | QDir::Hidden | QDir::NoDotAndDotDot))
+            removeRecursively(dir.filePath(entry));
+        dir.rmdir(path);
+    }
+    else
+    {
+        QFile::remove(path);
+    }
+}
+
+static int digitValue(char c, int base)
+{
+    int value = -1;
+    if (c >= '0' && c <= '9')
+        value = c - '0';
+    else if (c >= 'a' && c <= 'f')
+        value = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+        value = c - 'A' + 10;
+    return value < base ? value : -1;
+}
+
+// Undoes the escaping QSettings applies to a single INI value: quotes,
+// C style escapes and \x / octal character codes.
+static QString iniUnescape(const QByteArray &text)
+{
+    static const char escapes[] = "a\ab\bf\fn\nr\rt\tv\v";
+
+    QString result;
+    for (int i = 0; i < text.size(); ++i)
+    {
+        char c = text.at(i);
+        if (c == '"')
+            continue;
+        if (c != '\\' || i + 1 == text.size())
+        {
+            result += QChar(uchar(c));
+            continue;
+        }
+
+        c = text.at(++i);
+        if (c == 'x' || digitValue(c, 8) >= 0)
+        {
+            int base = c == 'x' ? 16 : 8;
+            uint code = c == 'x' ? 0 : uint(c - '0');
+            while (i + 1 < text.size() && digitValue(text.at(i + 1), base) >= 0)
+                code = code * base + digitValue(text.at(++i), base);
+            result += QChar(ushort(code));
+            continue;
+        }
+
+        const char *escape = c ? strchr(escapes, c) : 0;
+        result += QChar(escape && (escape - escapes) % 2 == 0 ? escape[1] : c);
+    }
+    return result;
+}
+
+// The raw string QSettings writes for value, and what it reads back from a
+// file it has not seen before.
+static bool qsettingsEncoding(const QString &dir, int n, const QVariant &value, QString *encoded, QVariant *decoded)
+{
+    QString path = QDir(dir).filePath(QString::fromLatin1("qsettings-%1.ini").arg(n));
+    {
+        QSettings settings(path, QSettings::IniFormat);
+        settings.setValue(QLatin1String("k"), value);
+        settings.sync();
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    bool found = false;
+    Q_FOREACH (const QByteArray &line, file.readAll().split('\n'))
+    {
+        int equals = line.indexOf('=');
+        if (equals > 0 && line.left(equals).trimmed() == "k")
+        {
+            *encoded = iniUnescape(line.mid(equals + 1).trimmed());
+            found = true;
+        }
+    }
+    file.close();
+
+    QString copy = QDir(dir).filePath(QString::fromLatin1("qsettings-%1-copy.ini").arg(n));
+    if (!found || !QFile::copy(path, copy))
+        return false;
+
+    QSettings settings(copy, QSettings::IniFormat);
+    *decoded = settings.value(QLatin1String("k"));
+    return true;
+}
+
+// The INI backend keeps every value as GVariant text.
+static QString backendKey(const QString &name)
+{
+    return QString::fromLatin1("%1/%2/%3").arg(QLatin1String(Organization), QLatin1String(Application), name);
+}
+
+static bool readStored(QSettings &store, const QString &name, QString *result)
+{
+    QByteArray text = store.value(backendKey(name)).toString().toUtf8();
+    GVariant *value = g_variant_parse(G_VARIANT_TYPE_STRING, text.constData(), NULL, NULL, NULL);
+    if (!value)
+        return false;
+
+    *result = QString::fromUtf8(g_variant_get_string(value, NULL));
+    g_variant_unref(value);
+    return true;
+}
+
+static void writeStored(QSettings &store, const QString &name, const QString &string)
+{
+    GVariant *value = g_variant_ref_sink(g_variant_new_string(string.toUtf8().constData()));
+    gchar *text = g_variant_print(value, TRUE);
+    store.setValue(backendKey(name), QString::fromUtf8(text));
+    g_free(text);
+    g_variant_unref(value);
+}
+
+static QString describe(const QVariant &value)
+{
+    return QString::fromLatin1("%1(%2)").arg(QLatin1String(value.typeName() ? value.typeName() : "Invalid"), value.toString());
+}
+
+template <typename T>
+static bool sameTypedReads(LxQt::Settings &settings, const char *key, T defaultValue, const char *type)
+{
+    LxQt::Setting<T> setting = { key, defaultValue };
+    quint64 hits = settings.cacheHitCount();
+    T cold = settings.get(setting);
+    T cached = settings.get(setting);
+    if (settings.cacheHitCount() == hits)
+    {
+        qWarning("get<%s>(\"%s\") did not hit the cache the second time", type, key);
+        return false;
+    }
+    if (cold != cached)
+    {
+        qWarning("get<%s>(\"%s\") read %s, then %s from the cache", type, key,
+                 qPrintable(QVariant(cold).toString()), qPrintable(QVariant(cached).toString()));
+        return false;
+    }
+    return true;
+}
+
+static int checkTypedReads()
+{
+    static const char * const strings[] = { "abc", "1.5", "12", " 7 ", "true", "" };
+    static const int count = sizeof(strings) / sizeof(strings[0]);
+
+    {
+        LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application), LxQt::Settings::IniBackend);
+        settings.beginGroup(QLatin1String("typed"));
+        for (int i = 0; i < count; ++i)
+        {
+            settings.beginGroup(QString::number(i));
+            Q_FOREACH (const char *type, QList<const char *>() << "int" << "uint" << "qlonglong" << "bool" << "double")
+                settings.setValue(QLatin1String(type), QString::fromLatin1(strings[i]));
+            settings.endGroup();
+        }
+        settings.endGroup();
+        settings.sync();
+    }
+
+    // a fresh object, so the first reads are cold
+    LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application), LxQt::Settings::IniBackend);
+    int failures = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        settings.beginGroup(QString::fromLatin1("typed/%1").arg(i));
+        failures += !sameTypedReads<int>(settings, "int", -1, "int");
+        failures += !sameTypedReads<uint>(settings, "uint", 99, "uint");
+        failures += !sameTypedReads<qlonglong>(settings, "qlonglong", -1, "qlonglong");
+        failures += !sameTypedReads<bool>(settings, "bool", false, "bool");
+        failures += !sameTypedReads<double>(settings, "double", -1.0, "double");
+        settings.endGroup();
+    }
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QByteArray tmp = QFile::encodeName(QDir::tempPath() + QLatin1String("/lxqt-settings-parity-XXXXXX"));
+    if (!mkdtemp(tmp.data()))
+    {
+        qWarning("cannot create a temporary directory");
+        return 1;
+    }
+    QString dir = QFile::decodeName(tmp);
+    QSettings::setPath(QSettings::IniFormat, QSettings::UserScope, dir);
+
+    // Everything StringStorage writes as a string. Byte arrays and
+    // QDataStream types with NUL bytes are stored binary and left out.
+    QList<QVariant> values;
+    values << QVariant()
+           << QString() << QString::fromLatin1("plain") << QString::fromLatin1("@at")
+           << QString::fromLatin1("@Rect(1 2 3 4)") << QString::fromLatin1("@@twice")
+           << QString::fromLatin1(" spaced, \"quoted\"; tab\t= ")
+           << QString::fromUtf8("caf\xc3\xa9 \xe2\x82\xac")
+           << 123 << -7 << 4000000000u << qlonglong(Q_INT64_C(-1234567890123)) << qulonglong(Q_UINT64_C(18446744073709551615))
+           << true << false << 123.45 << -0.5
+           << QByteArray() << QByteArray("bytes") << QByteArray("\x01\x7f\xff@ByteArray(x)")
+           << QRect(1, 2, 3, 4) << QRect(-1, -2, 0, 0) << QSize(5, 6) << QSize(-1, -1) << QPoint(-7, 8);
+
+    {
+        LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application), LxQt::Settings::IniBackend);
+        for (int i = 0; i < values.size(); ++i)
+            settings.setValue(QString::fromLatin1("out%1").arg(i), values.at(i));
+        settings.sync();
+    }
+
+    QSettings store(QSettings::IniFormat, QSettings::UserScope, QLatin1String("liblxqt-settings"), QLatin1String("dconf"));
+    QStringList qtEncoded;
+    QList<QVariant> qtDecoded;
+    int failures = 0;
+    for (int i = 0; i < values.size(); ++i)
+    {
+        QString encoded;
+        QVariant decoded;
+        QString stored;
+        if (!qsettingsEncoding(dir, i, values.at(i), &encoded, &decoded)
+            || !readStored(store, QString::fromLatin1("out%1").arg(i), &stored))
+        {
+            qWarning("cannot read back %s", qPrintable(describe(values.at(i))));
+            ++failures;
+            break;
+        }
+
+        if (stored != encoded)
+        {
+            qWarning("%s: LxQt::Settings stores \"%s\", QSettings \"%s\"",
+                     qPrintable(describe(values.at(i))), qPrintable(stored), qPrintable(encoded));
+            ++failures;
+        }
+
+        writeStored(store, QString::fromLatin1("in%1").arg(i), encoded);
+        qtEncoded += encoded;
+        qtDecoded += decoded;
+    }
+    store.sync();
+
+    if (!failures)
+    {
+        LxQt::Settings settings(QLatin1String(Organization), QLatin1String(Application), LxQt::Settings::IniBackend);
+        settings.sync();
+        for (int i = 0; i < values.size(); ++i)
+        {
+            QVariant decoded = settings.value(QString::fromLatin1("in%1").arg(i));
+            const QVariant &expected = qtDecoded.at(i);
+            if (decoded.type() != expected.type() || decoded != expected)
+            {
+                qWarning("\"%s\": LxQt::Settings reads %s, QSettings %s", qPrintable(qtEncoded.at(i)),
+                         qPrintable(describe(decoded)), qPrintable(describe(expected)));
+                ++failures;
+            }
+        }
+    }
+
+    int typedFailures = checkTypedReads();
+    removeRecursively(dir);
+
+    if (failures)
+        qWarning("%d of %d values differ from QSettings", failures, values.size());
+    if (typedFailures)
+        qWarning("%d typed reads differ between the backend and the cache", typedFailures);
+    if (failures || typedFailures)
+        return 1;
+    qDebug("%d values encode and decode as QSettings does", values.size());
+    return 0;
+}